@@ -0,0 +1,394 @@
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "td2.cpp"
+
+// Returns the running time of f in microseconds
+template <typename F>
+long time_us(F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(finish - start).count();
+}
+
+std::vector<double> random_doubles(size_t N) {
+    std::vector<double> result(N);
+    for (size_t i = 0; i < N; ++i) {
+        result[i] = rand() - RAND_MAX / 2;
+    }
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+
+// Compares one segmented scan over the concatenation with one PrefixMaximums call per segment
+void benchmark_segmented(size_t num_threads, size_t N) {
+    std::vector<double> values = random_doubles(N);
+    std::vector<double> result(N);
+    size_t segment_lengths[] = {16, 1000, 100000, N};
+    for (size_t segment : segment_lengths) {
+        if (segment < num_threads + 1 || segment > N) {
+            continue;
+        }
+        std::vector<size_t> offsets;
+        std::vector<unsigned char> heads(N, 0);
+        for (size_t i = 0; i < N; i += segment) {
+            offsets.push_back(i);
+            heads[i] = 1;
+        }
+        long per_segment = time_us([&] {
+            for (size_t k = 0; k < offsets.size(); ++k) {
+                size_t len = std::min(segment, N - offsets[k]);
+                if (len > num_threads) {
+                    PrefixMaximums(values.data() + offsets[k], len, num_threads, result.data() + offsets[k]);
+                }
+            }
+        });
+        long flags = time_us([&] {
+            SegmentedPrefixMaximums(values.data(), heads.data(), N, num_threads, result.data());
+        });
+        long offs = time_us([&] {
+            SegmentedPrefixMaximums(values.data(), offsets.data(), offsets.size(), N, num_threads, result.data());
+        });
+        std::cout << segment << " " << per_segment << " " << flags << " " << offs << std::endl;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+template <typename Table>
+void report_rmq(const std::string& name, const std::vector<double>& values, size_t num_threads,
+                const std::vector<size_t>& lo, const std::vector<size_t>& hi) {
+    Table* table = nullptr;
+    long build = time_us([&] {
+        table = new Table(values.data(), values.size(), num_threads);
+    });
+    std::vector<double> out(lo.size());
+    long queries = time_us([&] {
+        table->query(lo.data(), hi.data(), lo.size(), out.data(), num_threads);
+    });
+    std::cout << name << " " << build << " "
+              << (double) table->memory_bytes() / values.size() << " "
+              << (double) lo.size() / std::max(queries, 1L) << std::endl;
+    delete table;
+}
+
+// Builds both range-max structures and answers 10^7 random window queries
+void benchmark_rmq(size_t num_threads, size_t N) {
+    std::vector<double> values = random_doubles(N);
+    size_t Q = 10000000;
+    std::vector<size_t> lo(Q), hi(Q);
+    for (size_t q = 0; q < Q; ++q) {
+        lo[q] = rand() % N;
+        hi[q] = lo[q] + 1 + rand() % (N - lo[q]);
+    }
+    report_rmq<SparseTableMax<double>>("SparseTableMax", values, num_threads, lo, hi);
+    report_rmq<BlockSparseTableMax<double>>("BlockSparseTableMax", values, num_threads, lo, hi);
+}
+
+//-----------------------------------------------------------------------------
+
+// Throughput of the compaction routines, memcpy of the whole array giving the bandwidth reference
+void benchmark_compact(size_t num_threads, size_t N) {
+    std::vector<double> values = random_doubles(N);
+    std::vector<double> out(N);
+    double bytes = (double) N * sizeof(double);
+    auto gbs = [bytes](long us) { return bytes / std::max(us, 1L) / 1000.; };
+    double selectivities[] = {0.1, 0.5, 0.9};
+    for (double selectivity : selectivities) {
+        double threshold = selectivity * RAND_MAX - RAND_MAX / 2;
+        auto pred = [threshold](double x) { return x < threshold; };
+        long copy = time_us([&] { std::copy(values.begin(), values.end(), out.begin()); });
+        long serial = time_us([&] { std::copy_if(values.begin(), values.end(), out.begin(), pred); });
+        long stable = time_us([&] { CopyIfParallel(values.data(), N, out.data(), pred, num_threads); });
+        long unstable = time_us([&] { CopyIfParallel(values.data(), N, out.data(), pred, num_threads, false); });
+        long part_stable = time_us([&] { PartitionParallel(values.data(), N, out.data(), pred, num_threads); });
+        long part_unstable = time_us([&] { PartitionParallel(values.data(), N, out.data(), pred, num_threads, false); });
+        std::cout << selectivity << " " << gbs(copy) << " " << gbs(serial) << " " << gbs(stable) << " "
+                  << gbs(unstable) << " " << gbs(part_stable) << " " << gbs(part_unstable) << std::endl;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+template <typename T>
+void report_radix(const std::string& name, const std::vector<T>& keys, size_t num_threads) {
+    std::vector<T> work = keys;
+    long sort = time_us([&] { std::sort(work.begin(), work.end()); });
+    work = keys;
+    long stable = time_us([&] { std::stable_sort(work.begin(), work.end()); });
+    work = keys;
+    long radix = time_us([&] { RadixSortParallel(work.data(), work.size(), num_threads); });
+    work = keys;
+    std::vector<size_t> perm;
+    long radix_perm = time_us([&] { RadixSortParallel(work.data(), work.size(), num_threads, perm); });
+    std::cout << name << " " << sort << " " << stable << " " << radix << " " << radix_perm << std::endl;
+}
+
+void benchmark_radix(size_t num_threads, size_t N) {
+    std::vector<uint32_t> u32(N);
+    std::vector<uint64_t> u64(N);
+    std::vector<int> i32(N);
+    std::vector<float> f32(N);
+    std::vector<double> f64(N);
+    for (size_t i = 0; i < N; ++i) {
+        u32[i] = rand();
+        u64[i] = (uint64_t(rand()) << 31) ^ rand();
+        i32[i] = rand() - RAND_MAX / 2;
+        f32[i] = (float) (rand() - RAND_MAX / 2);
+        f64[i] = (double) (rand() - RAND_MAX / 2) / RAND_MAX;
+    }
+    report_radix("uint32_t", u32, num_threads);
+    report_radix("uint64_t", u64, num_threads);
+    report_radix("int", i32, num_threads);
+    report_radix("float", f32, num_threads);
+    report_radix("double", f64, num_threads);
+}
+
+//-----------------------------------------------------------------------------
+
+// Batched calls against one PrefixMaximums / MaxParallel call per row, for N elements
+// arranged as many short rows or a few long ones
+void benchmark_batched(size_t num_threads, size_t N) {
+    std::vector<double> values = random_doubles(N);
+    std::vector<double> result(N);
+    size_t row_lengths[] = {64, 4096, N / 4};
+    for (size_t cols : row_lengths) {
+        size_t rows = N / cols;
+        if (cols <= num_threads) {
+            continue;
+        }
+        long per_row = time_us([&] {
+            for (size_t r = 0; r < rows; ++r) {
+                PrefixMaximums(values.data() + r * cols, cols, num_threads, result.data() + r * cols);
+            }
+        });
+        long batched = time_us([&] {
+            BatchedPrefixMaximums(values.data(), rows, cols, cols, num_threads, result.data());
+        });
+        long per_row_max = time_us([&] {
+            for (size_t r = 0; r < rows; ++r) {
+                result[r] = MaxParallel(values.data() + r * cols, cols, num_threads);
+            }
+        });
+        long batched_max = time_us([&] {
+            BatchedMaxParallel(values.data(), rows, cols, cols, num_threads, result.data());
+        });
+        std::cout << rows << "x" << cols << " " << per_row << " " << batched << " "
+                  << per_row_max << " " << batched_max << std::endl;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+// Classic O(N) sliding-window maximum keeping a deque of decreasing candidates
+void SlidingWindowMaxDeque(const double* start, size_t N, size_t W, double* res_start) {
+    std::deque<size_t> candidates;
+    for (size_t i = 0; i < N; ++i) {
+        while (!candidates.empty() && start[candidates.back()] <= start[i]) {
+            candidates.pop_back();
+        }
+        candidates.push_back(i);
+        if (candidates.front() + W <= i) {
+            candidates.pop_front();
+        }
+        if (i + 1 >= W) {
+            res_start[i + 1 - W] = start[candidates.front()];
+        }
+    }
+}
+
+void benchmark_window(size_t num_threads, size_t N) {
+    std::vector<double> values = random_doubles(N);
+    std::vector<double> result(N);
+    size_t windows[] = {8, 64, 1000, 100000, 1000000};
+    for (size_t W : windows) {
+        if (W > N) {
+            continue;
+        }
+        long deque = time_us([&] { SlidingWindowMaxDeque(values.data(), N, W, result.data()); });
+        long batch = time_us([&] { SlidingWindowMax(values.data(), N, W, num_threads, result.data()); });
+        long stream = time_us([&] {
+            SlidingWindowStream<double, std::greater<double>> s(W);
+            for (size_t i = 0; i < N; ++i) {
+                s.push(values[i]);
+                result[i] = s.current();
+            }
+        });
+        std::cout << W << " " << deque << " " << batch << " " << stream << std::endl;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+// Textbook summed-area table: s[i][j] = a[i][j] + s[i-1][j] + s[i][j-1] - s[i-1][j-1]
+void SummedAreaTableNaive(const double* start, size_t rows, size_t cols, double* res_start) {
+    for (size_t i = 0; i < rows; ++i) {
+        for (size_t j = 0; j < cols; ++j) {
+            double s = start[i * cols + j];
+            if (i > 0) s += res_start[(i - 1) * cols + j];
+            if (j > 0) s += res_start[i * cols + j - 1];
+            if (i > 0 && j > 0) s -= res_start[(i - 1) * cols + j - 1];
+            res_start[i * cols + j] = s;
+        }
+    }
+}
+
+// N is the side of the square grid
+void benchmark_grid(size_t num_threads, size_t N) {
+    std::vector<double> values = random_doubles(N * N);
+    std::vector<double> result(N * N);
+    long naive = time_us([&] { SummedAreaTableNaive(values.data(), N, N, result.data()); });
+    long sat = time_us([&] { SummedAreaTable(values.data(), N, N, N, num_threads, result.data()); });
+    long pmax = time_us([&] { PrefixMaximums2D(values.data(), N, N, N, num_threads, result.data()); });
+    std::cout << N << " " << naive << " " << sat << " " << pmax << std::endl;
+}
+
+//-----------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cout << "Usage: ./benchmarker benchmark num_threads N" << std::endl;
+        std::cout << "  benchmark is one of: segmented, rmq, compact, radix, batched, window, grid" << std::endl;
+        return 0;
+    }
+
+    std::string benchmark = argv[1];
+    size_t num_threads = std::stoul(argv[2]);
+    size_t N = std::stoul(argv[3]);
+
+    if (benchmark == "segmented") {
+        std::cout << "segment length, PrefixMaximums per segment, segmented (flags), segmented (offsets), in microseconds" << std::endl;
+        benchmark_segmented(num_threads, N);
+    } else if (benchmark == "rmq") {
+        std::cout << "structure, build time (microseconds), bytes per element, million queries per second" << std::endl;
+        benchmark_rmq(num_threads, N);
+    } else if (benchmark == "compact") {
+        std::cout << "selectivity, memcpy, std::copy_if, CopyIfParallel stable, unstable, PartitionParallel stable, unstable (GB/s read)" << std::endl;
+        benchmark_compact(num_threads, N);
+    } else if (benchmark == "radix") {
+        std::cout << "key type, std::sort, std::stable_sort, RadixSortParallel, RadixSortParallel with permutation (microseconds)" << std::endl;
+        benchmark_radix(num_threads, N);
+    } else if (benchmark == "batched") {
+        std::cout << "rows x cols, per-row PrefixMaximums, BatchedPrefixMaximums, per-row MaxParallel, BatchedMaxParallel (microseconds)" << std::endl;
+        benchmark_batched(num_threads, N);
+    } else if (benchmark == "window") {
+        std::cout << "W, monotonic deque, SlidingWindowMax, SlidingWindowStream (microseconds)" << std::endl;
+        benchmark_window(num_threads, N);
+    } else if (benchmark == "grid") {
+        std::cout << "side, naive summed-area table, SummedAreaTable, PrefixMaximums2D (microseconds)" << std::endl;
+        benchmark_grid(num_threads, N);
+    } else {
+        std::cout << "Unknown benchmark " << benchmark << std::endl;
+        return 1;
+    }
+}
+
+/*
+
+SPACE TO REPORT AND ANALYZE THE RUNTIMES
+
+./benchmarker segmented 4 2000000
+1st column : segment length;
+2nd column : PrefixMaximums called on every segment;
+3rd column : SegmentedPrefixMaximums with head flags;
+4th column : SegmentedPrefixMaximums with offsets.
+16 19151168 10225 5926
+1000 266683 7551 8252
+100000 11633 11111 7979
+2000000 8659 11669 9291
+
+A single segmented scan spawns 2 * num_threads threads whatever the number of
+segments, while calling PrefixMaximums per segment pays the thread creation for
+every segment, which dominates for segments of a few dozen elements. For a
+single huge segment both versions are within noise of each other (measured on a
+single-core machine, so no speedup is expected from the threads themselves).
+
+./benchmarker rmq 4 10000000 (10^7 random queries)
+structure, build time (microseconds), bytes per element, million queries per second
+SparseTableMax 2572658 178.578 27.7888
+BlockSparseTableMax 180491 20.3306 22.1488
+
+The block-decomposed table is 9 times smaller and an order of magnitude faster
+to build, since only the N / 32 block maximums get a full sparse table. Its
+queries are slightly slower: they touch three arrays, and the short ones scan
+up to a block.
+
+./benchmarker compact 4 20000000
+selectivity, memcpy, std::copy_if, CopyIfParallel stable, unstable, PartitionParallel stable, unstable (GB/s read)
+0.1 5.37833 2.93918 2.26725 3.10222 1.91077 1.58223
+0.5 5.238 1.22633 1.94161 2.48204 1.88866 1.58145
+0.9 5.97952 3.19776 2.02598 2.33311 1.95513 1.82746
+
+Thanks to the branch-free inner loops the parallel versions do not depend on
+the selectivity, whereas std::copy_if collapses at 50% on mispredictions. The
+unstable copy reads the input once and is the closest to memcpy; with more
+cores than this machine has, the stable version approaches it as well since
+both of its passes are bandwidth-bound.
+
+./benchmarker radix 4 1000000, then 10000000
+key type, std::sort, std::stable_sort, RadixSortParallel, RadixSortParallel with permutation (microseconds)
+uint32_t 111154 117888 20078 70385
+uint64_t 107225 117382 50556 139748
+int 103001 112647 19476 63897
+float 95681 107972 19461 57285
+double 91871 140491 39884 135691
+
+uint32_t 1197599 1507992 344962 917937
+uint64_t 1094981 1537830 825911 1376697
+int 1135879 1384816 304957 675769
+float 1208808 1506195 317340 662881
+double 1236577 1703472 796661 1588302
+
+Even on one core the radix sort beats std::sort by 3-5x on 32-bit keys and
+1.5-2x on 64-bit keys (8 passes instead of 4). Carrying the permutation doubles
+the scattered bytes for 32-bit keys, hence the gap. 10^9 keys do not fit in the
+memory of this machine; the cost per key stays flat for the radix sort while it
+grows with log N for the comparison sorts.
+
+./benchmarker batched 4 4000000
+rows x cols, per-row PrefixMaximums, BatchedPrefixMaximums, per-row MaxParallel, BatchedMaxParallel (microseconds)
+62500x64 5823542 8083 2313219 8498
+976x4096 81933 9119 44882 8085
+4x1000000 10920 6731 7150 6704
+
+./benchmarker batched 8 4000000
+rows x cols, per-row PrefixMaximums, BatchedPrefixMaximums, per-row MaxParallel, BatchedMaxParallel (microseconds)
+62500x64 17997281 8115 10365533 11161
+976x4096 324431 9685 163252 9585
+4x1000000 18292 16665 10280 13526
+
+With short rows the per-row calls only measure thread creation (700x slower).
+For 4 long rows and 4 threads the batched version gives a row to each thread.
+With 8 threads it splits every row between them instead, running each phase
+over all the rows, so threads are spawned twice for the batch rather than
+twice per row; with rows this long the 6 spawns saved are lost in the noise.
+
+./benchmarker window 4 10000000
+W, monotonic deque, SlidingWindowMax, SlidingWindowStream (microseconds)
+8 155161 43808 109579
+64 171852 39910 96905
+1000 174828 38618 80022
+100000 164675 44098 79898
+1000000 160140 72777 93956
+
+The van Herk / Gil-Werman decomposition is independent of W and branch-light,
+so even on one core the batch version is 2-4x faster than the deque, whose
+cost is dominated by unpredictable pops. The streaming form pays a call per
+value but still beats the deque.
+
+./benchmarker grid 4 4096, then 8192
+side, naive summed-area table, SummedAreaTable, PrefixMaximums2D (microseconds)
+4096 109745 60382 68109
+8192 310259 231731 236699
+
+An 8k x 8k grid of doubles takes under a quarter of a second on a single core.
+The vertical pass is an SSE2 add/max of two contiguous rows, so both passes are
+bandwidth-bound and the threads split them without sharing any line.
+
+*/
@@ -80,6 +80,55 @@ int test_max_parallel(std::ostream &out, const std::string test_name) {
 
 //-----------------------------------------------------------------------------
 
+int test_argmax_parallel(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "ArgMaxParallel";
+
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    // Empty input
+    double empty[1];
+    ExtremumResult<double> none = ArgMaxParallel(empty, 0, 3);
+    res.push_back(test_eq(out, fun_name, none.found, false));
+    MinMaxResult<double> none_mm = MinMaxParallel(empty, 0, 3);
+    res.push_back(test_eq(out, "MinMaxParallel", none_mm.min.found || none_mm.max.found, false));
+
+    for (size_t i = 0; i < 100; ++i) {
+        size_t len = (rand() % 1000) + 1;
+        std::vector<double> test(len);
+        for (size_t j = 0; j < len; ++j) {
+            // few distinct values so that ties are frequent
+            test[j] = (i % 2 == 0) ? rand() % 20 : rand() - RAND_MAX / 2;
+        }
+        size_t num_threads = 1 + (rand() % 5);
+        size_t correct_max = std::max_element(test.begin(), test.end()) - test.begin();
+        size_t correct_min = std::min_element(test.begin(), test.end()) - test.begin();
+        ExtremumResult<double> student_result = ArgMaxParallel(test.data(), len, num_threads);
+        res.push_back(test_eq(out, fun_name, student_result.index, correct_max));
+        MinMaxResult<double> mm = MinMaxParallel(test.data(), len, num_threads);
+        res.push_back(test_eq(out, "MinMaxParallel", mm.max.index, correct_max));
+        res.push_back(test_eq(out, "MinMaxParallel", mm.min.index, correct_min));
+    }
+
+    // Custom comparator on integers: largest absolute value
+    for (size_t i = 0; i < 50; ++i) {
+        size_t len = (rand() % 500) + 1;
+        std::vector<int> test(len);
+        for (size_t j = 0; j < len; ++j) {
+            test[j] = rand() % 41 - 20;
+        }
+        auto abs_less = [](int a, int b) { return std::abs(a) < std::abs(b); };
+        size_t correct = std::max_element(test.begin(), test.end(), abs_less) - test.begin();
+        ExtremumResult<int> student_result = ArgMaxParallel(test.data(), len, 1 + (rand() % 5), abs_less);
+        res.push_back(test_eq(out, fun_name, student_result.index, correct));
+    }
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
 void PrefixMaximumsSeq(double* start, int N, double* res) {
     res[0] = start[0];
     for (size_t i = 1; i < N; ++i) {
@@ -154,6 +203,325 @@ int test_prexif_maximums(std::ostream &out, const std::string test_name) {
 
 //-----------------------------------------------------------------------------
 
+int test_segmented_prefix_maximums(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "SegmentedPrefixMaximums";
+
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    for (size_t i = 0; i < 100; ++i) {
+        size_t len = (rand() % 2000) + 1;
+        // alternate between many tiny and a few long segments
+        size_t mean_segment = (i % 2 == 0) ? 3 : 500;
+        std::vector<double> test(len);
+        std::vector<unsigned char> heads(len, 0);
+        std::vector<size_t> offsets;
+        for (size_t j = 0; j < len; ++j) {
+            test[j] = rand() - RAND_MAX / 2;
+            if (j == 0 || rand() % mean_segment == 0) {
+                heads[j] = 1;
+                offsets.push_back(j);
+            }
+        }
+        std::vector<double> correct_result(len);
+        for (size_t j = 0; j < len; ++j) {
+            correct_result[j] = heads[j] ? test[j] : std::max(test[j], correct_result[j - 1]);
+        }
+        size_t num_threads = 1 + (rand() % 5);
+        std::vector<double> from_flags(len), from_offsets(len);
+        SegmentedPrefixMaximums(test.data(), heads.data(), len, num_threads, from_flags.data());
+        SegmentedPrefixMaximums(test.data(), offsets.data(), offsets.size(), len, num_threads, from_offsets.data());
+        res.push_back(test_eq(out, fun_name, from_flags == correct_result, true));
+        res.push_back(test_eq(out, fun_name, from_offsets == correct_result, true));
+    }
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_sparse_table(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "SparseTableMax";
+
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    for (size_t i = 0; i < 50; ++i) {
+        size_t len = (rand() % 5000) + 1;
+        std::vector<double> test(len);
+        for (size_t j = 0; j < len; ++j) {
+            test[j] = rand() - RAND_MAX / 2;
+        }
+        size_t num_threads = 1 + (rand() % 5);
+        SparseTableMax<double> table(test.data(), len, num_threads);
+        BlockSparseTableMax<double> block_table(test.data(), len, num_threads);
+
+        size_t Q = 200;
+        std::vector<size_t> lo(Q), hi(Q);
+        std::vector<double> correct(Q), got(Q), got_block(Q);
+        for (size_t q = 0; q < Q; ++q) {
+            lo[q] = rand() % len;
+            hi[q] = lo[q] + 1 + rand() % (len - lo[q]);
+            correct[q] = *std::max_element(test.begin() + lo[q], test.begin() + hi[q]);
+        }
+        table.query(lo.data(), hi.data(), Q, got.data(), num_threads);
+        block_table.query(lo.data(), hi.data(), Q, got_block.data(), num_threads);
+        res.push_back(test_eq(out, fun_name, got == correct, true));
+        res.push_back(test_eq(out, "BlockSparseTableMax", got_block == correct, true));
+    }
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_copy_if_parallel(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "CopyIfParallel";
+
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    for (size_t i = 0; i < 40; ++i) {
+        size_t len = (i == 0) ? 0 : (rand() % 100000) + 1;
+        std::vector<double> test(len);
+        for (size_t j = 0; j < len; ++j) {
+            test[j] = rand() - RAND_MAX / 2;
+        }
+        // selectivity between 0% and 100%
+        double threshold = (double) (i % 5) / 4 * RAND_MAX - RAND_MAX / 2;
+        auto pred = [threshold](double x) { return x < threshold; };
+        size_t num_threads = 1 + (rand() % 5);
+
+        std::vector<double> correct;
+        std::copy_if(test.begin(), test.end(), std::back_inserter(correct), pred);
+        std::vector<double> correct_partition = test;
+        std::stable_partition(correct_partition.begin(), correct_partition.end(), pred);
+
+        std::vector<double> student(len);
+        size_t k = CopyIfParallel(test.data(), len, student.data(), pred, num_threads);
+        student.resize(k);
+        res.push_back(test_eq(out, fun_name, student == correct, true));
+
+        student.assign(len, 0.);
+        k = CopyIfParallel(test.data(), len, student.data(), pred, num_threads, false);
+        student.resize(k);
+        std::sort(student.begin(), student.end());
+        std::vector<double> sorted_correct = correct;
+        std::sort(sorted_correct.begin(), sorted_correct.end());
+        res.push_back(test_eq(out, fun_name + " (unstable)", student == sorted_correct, true));
+
+        student.assign(len, 0.);
+        k = PartitionParallel(test.data(), len, student.data(), pred, num_threads);
+        res.push_back(test_eq(out, "PartitionParallel", k == correct.size() && student == correct_partition, true));
+
+        student.assign(len, 0.);
+        k = PartitionParallel(test.data(), len, student.data(), pred, num_threads, false);
+        bool partitioned = (k == correct.size());
+        for (size_t j = 0; j < len; ++j) {
+            partitioned = partitioned && (pred(student[j]) == (j < k));
+        }
+        std::sort(student.begin(), student.end());
+        std::vector<double> sorted_test = test;
+        std::sort(sorted_test.begin(), sorted_test.end());
+        res.push_back(test_eq(out, "PartitionParallel (unstable)", partitioned && student == sorted_test, true));
+    }
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+template <typename T>
+int check_radix_sort(std::ostream &out, std::vector<T> test, size_t num_threads) {
+    std::vector<T> correct = test;
+    std::stable_sort(correct.begin(), correct.end());
+    std::vector<T> original = test;
+    std::vector<size_t> perm;
+    RadixSortParallel(test.data(), test.size(), num_threads, perm);
+    bool success = (test == correct);
+    // the permutation must be the one of a stable sort
+    for (size_t i = 0; success && i < test.size(); ++i) {
+        success = (original[perm[i]] == test[i]) && (i == 0 || test[i - 1] != test[i] || perm[i - 1] < perm[i]);
+    }
+    return test_eq(out, "RadixSortParallel", success, true);
+}
+
+int test_radix_sort(std::ostream &out, const std::string test_name) {
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    for (size_t i = 0; i < 20; ++i) {
+        size_t len = (i == 0) ? 0 : (rand() % 50000) + 1;
+        size_t num_threads = 1 + (rand() % 5);
+        std::vector<uint32_t> u32(len);
+        std::vector<uint64_t> u64(len);
+        std::vector<int> i32(len);
+        std::vector<float> f32(len);
+        std::vector<double> f64(len);
+        for (size_t j = 0; j < len; ++j) {
+            // a narrow range on odd iterations gives many equal keys and skipped passes
+            int r = (i % 2 == 0) ? rand() : rand() % 100;
+            u32[j] = r;
+            u64[j] = (uint64_t(rand()) << 33) ^ r;
+            i32[j] = r - RAND_MAX / 2;
+            f32[j] = (float) (r - RAND_MAX / 2) / 1000;
+            f64[j] = (double) (r - RAND_MAX / 2) / 1000;
+        }
+        res.push_back(check_radix_sort(out, u32, num_threads));
+        res.push_back(check_radix_sort(out, u64, num_threads));
+        res.push_back(check_radix_sort(out, i32, num_threads));
+        res.push_back(check_radix_sort(out, f32, num_threads));
+        res.push_back(check_radix_sort(out, f64, num_threads));
+    }
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_batched(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "BatchedPrefixMaximums";
+
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    // many short rows, then a few rows long enough to be split between threads
+    size_t shapes[][2] = {{1, 1}, {100, 7}, {1000, 50}, {2, 100000}, {1, 50000}};
+    for (auto& shape : shapes) {
+        size_t rows = shape[0], cols = shape[1];
+        size_t stride = cols + (rand() % 3);
+        std::vector<double> test(rows * stride);
+        for (size_t j = 0; j < test.size(); ++j) {
+            test[j] = rand() - RAND_MAX / 2;
+        }
+        // at least 2, so that the single long row is always split
+        size_t num_threads = 2 + (rand() % 4);
+        std::vector<double> student(rows * stride), student_max(rows);
+        BatchedPrefixMaximums(test.data(), rows, cols, stride, num_threads, student.data());
+        BatchedMaxParallel(test.data(), rows, cols, stride, num_threads, student_max.data());
+        bool prefix_ok = true, max_ok = true;
+        for (size_t r = 0; r < rows; ++r) {
+            double current = -DBL_MAX;
+            for (size_t c = 0; c < cols; ++c) {
+                current = std::max(current, test[r * stride + c]);
+                prefix_ok = prefix_ok && (student[r * stride + c] == current);
+            }
+            max_ok = max_ok && (student_max[r] == current);
+        }
+        res.push_back(test_eq(out, fun_name, prefix_ok, true));
+        res.push_back(test_eq(out, "BatchedMaxParallel", max_ok, true));
+    }
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_sliding_window(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "SlidingWindowMax";
+
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    for (size_t i = 0; i < 60; ++i) {
+        size_t len = (rand() % 20000) + 1;
+        size_t W = 1 + ((i % 3 == 0) ? rand() % 10 : rand() % len);
+        W = std::min(W, len);
+        std::vector<int> test(len);
+        for (size_t j = 0; j < len; ++j) {
+            test[j] = rand() % 1000 - 500;
+        }
+        std::vector<int> correct_max(len - W + 1), correct_min(len - W + 1);
+        for (size_t j = 0; j + W <= len; ++j) {
+            correct_max[j] = *std::max_element(test.begin() + j, test.begin() + j + W);
+            correct_min[j] = *std::min_element(test.begin() + j, test.begin() + j + W);
+        }
+        size_t num_threads = 1 + (rand() % 5);
+        std::vector<int> student_max(len - W + 1), student_min(len - W + 1);
+        SlidingWindowMax(test.data(), len, W, num_threads, student_max.data());
+        SlidingWindowMin(test.data(), len, W, num_threads, student_min.data());
+        res.push_back(test_eq(out, fun_name, student_max == correct_max, true));
+        res.push_back(test_eq(out, "SlidingWindowMin", student_min == correct_min, true));
+
+        SlidingWindowStream<int, std::greater<int>> stream(W);
+        bool stream_ok = true;
+        for (size_t j = 0; j < len; ++j) {
+            stream.push(test[j]);
+            if (stream.full()) {
+                stream_ok = stream_ok && (stream.current() == correct_max[j + 1 - W]);
+            }
+        }
+        res.push_back(test_eq(out, "SlidingWindowStream", stream_ok, true));
+    }
+
+    SlidingWindowStream<int, std::greater<int>> empty_window(0);
+    empty_window.push(1);
+    empty_window.push(2);
+    res.push_back(test_eq(out, "SlidingWindowStream", empty_window.full(), false));
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_prefix_grid(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "SummedAreaTable";
+
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    size_t shapes[][2] = {{1, 1}, {1, 2000}, {2000, 1}, {37, 1100}, {300, 300}};
+    for (auto& shape : shapes) {
+        size_t rows = shape[0], cols = shape[1];
+        size_t stride = cols + (rand() % 3);
+        // small integers keep the sums exact
+        std::vector<double> test(rows * stride);
+        for (size_t j = 0; j < test.size(); ++j) {
+            test[j] = rand() % 100 - 50;
+        }
+        size_t num_threads = 1 + (rand() % 5);
+        std::vector<double> sat(rows * stride), pmax(rows * stride);
+        SummedAreaTable(test.data(), rows, cols, stride, num_threads, sat.data());
+        PrefixMaximums2D(test.data(), rows, cols, stride, num_threads, pmax.data());
+        bool sat_ok = true, max_ok = true;
+        std::vector<double> sum_above(cols, 0.), max_above(cols, -DBL_MAX);
+        for (size_t r = 0; r < rows; ++r) {
+            double row_sum = 0., row_max = -DBL_MAX;
+            for (size_t c = 0; c < cols; ++c) {
+                row_sum += test[r * stride + c];
+                row_max = std::max(row_max, test[r * stride + c]);
+                sum_above[c] += row_sum;
+                max_above[c] = std::max(max_above[c], row_max);
+                sat_ok = sat_ok && (sat[r * stride + c] == sum_above[c]);
+                max_ok = max_ok && (pmax[r * stride + c] == max_above[c]);
+            }
+        }
+        res.push_back(test_eq(out, fun_name, sat_ok, true));
+        res.push_back(test_eq(out, "PrefixMaximums2D", max_ok, true));
+
+        size_t r0 = rand() % rows, c0 = rand() % cols;
+        size_t r1 = r0 + 1 + rand() % (rows - r0), c1 = c0 + 1 + rand() % (cols - c0);
+        double box = 0.;
+        for (size_t r = r0; r < r1; ++r) {
+            for (size_t c = c0; c < c1; ++c) {
+                box += test[r * stride + c];
+            }
+        }
+        res.push_back(test_eq(out, "BoxSum", BoxSum(sat.data(), stride, r0, c0, r1, c1), box));
+    }
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
 int grading(std::ostream &out, const int test_case_number)
 {
 /**
@@ -162,25 +530,49 @@ Annotations used for the autograder.
 
 [START-AUTOGRADER-ANNOTATION]
 {
-  "total" : 2,
+  "total" : 10,
   "names" : [
       "td2.cpp::MaxParallel_test",
-      "td2.cpp::PrefixSums_test"
+      "td2.cpp::PrefixSums_test",
+      "td2.cpp::ArgMaxParallel_test",
+      "td2.cpp::SegmentedPrefixMaximums_test",
+      "td2.cpp::SparseTableMax_test",
+      "td2.cpp::CopyIfParallel_test",
+      "td2.cpp::RadixSortParallel_test",
+      "td2.cpp::BatchedPrefixMaximums_test",
+      "td2.cpp::SlidingWindow_test",
+      "td2.cpp::PrefixGrid_test"
   ],
-  "points" : [5, 5]
+  "points" : [5, 5, 5, 5, 5, 5, 5, 5, 5, 5]
 }
 [END-AUTOGRADER-ANNOTATION]
 */
 
-    int const total_test_cases = 2;
+    int const total_test_cases = 10;
     std::string const test_names[total_test_cases] = {
         "MaxParallel_test",
-        "PrefixMaximums_test"
+        "PrefixMaximums_test",
+        "ArgMaxParallel_test",
+        "SegmentedPrefixMaximums_test",
+        "SparseTableMax_test",
+        "CopyIfParallel_test",
+        "RadixSortParallel_test",
+        "BatchedPrefixMaximums_test",
+        "SlidingWindow_test",
+        "PrefixGrid_test"
     };
-    int const points[total_test_cases] = {5, 5};
+    int const points[total_test_cases] = {5, 5, 5, 5, 5, 5, 5, 5, 5, 5};
     int (*test_functions[total_test_cases]) (std::ostream &, const std::string) = {
         test_max_parallel,
-        test_prexif_maximums
+        test_prexif_maximums,
+        test_argmax_parallel,
+        test_segmented_prefix_maximums,
+        test_sparse_table,
+        test_copy_if_parallel,
+        test_radix_sort,
+        test_batched,
+        test_sliding_window,
+        test_prefix_grid
     };
 
     return run_grading(out, test_case_number, total_test_cases,
@@ -1,53 +1,292 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <cfloat>
 #include <climits>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <thread>
 #include <numeric>
 #include <iterator>
+#include <limits>
+#include <memory>
 #include <vector>
 #include <mutex>
 #include <chrono>
 #include <iostream>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//-----------------------------------------------------------------------------
+// Worker infrastructure shared by the parallel routines of this file
+
+// Size of a cache line, used to pad per-worker slots against false sharing
+const size_t CACHE_LINE_SIZE = 64;
+
+// Returns the first index of the i-th of num_chunks contiguous chunks of [0, N),
+// the last chunk absorbing the remainder
+inline size_t ChunkBegin(size_t N, size_t num_chunks, size_t i) {
+    return (N / num_chunks) * i;
+}
+
+inline size_t ChunkEnd(size_t N, size_t num_chunks, size_t i) {
+    return (i == num_chunks - 1) ? N : (N / num_chunks) * (i + 1);
+}
+
+// Below this many elements per thread, spawning a thread costs more than it saves
+const size_t MIN_ITEMS_PER_THREAD = 4096;
+
+// Number of threads worth using for work items, at most num_threads
+inline size_t UsefulThreads(size_t num_threads, size_t work) {
+    return std::max<size_t>(1, std::min(num_threads, work / MIN_ITEMS_PER_THREAD));
+}
+
+// Runs f(0), ..., f(num_threads - 1), each in its own thread,
+// the last one being executed by the calling thread
+template <typename F>
+void RunWorkers(size_t num_threads, F f) {
+    if (num_threads == 0) {
+        return;
+    }
+    std::vector<std::thread> workers(num_threads - 1);
+    for (size_t i = 0; i < num_threads - 1; ++i) {
+        workers[i] = std::thread(f, i);
+    }
+    f(num_threads - 1);
+    for (size_t i = 0; i < num_threads - 1; ++i) {
+        workers[i].join();
+    }
+}
+
+// A per-worker result slot occupying a full cache line
+template <typename T>
+struct alignas(CACHE_LINE_SIZE) PaddedSlot {
+    T value;
+};
+
+// Position and value of an extreme element; found is false (and index is N)
+// when the array was empty
+template <typename T>
+struct ExtremumResult {
+    T value;
+    size_t index;
+    bool found;
+};
+
+template <typename T>
+struct MinMaxResult {
+    ExtremumResult<T> min;
+    ExtremumResult<T> max;
+};
+
+// Merges the result of a later chunk into the result of an earlier one:
+// ties are resolved in favour of the earlier chunk, as in std::max_element
+template <typename T, typename Compare>
+void MergeArgMax(ExtremumResult<T>& acc, const ExtremumResult<T>& other, Compare comp) {
+    if (other.found && (!acc.found || comp(acc.value, other.value))) {
+        acc = other;
+    }
+}
+
+template <typename T, typename Compare>
+void MergeArgMin(ExtremumResult<T>& acc, const ExtremumResult<T>& other, Compare comp) {
+    if (other.found && (!acc.found || comp(other.value, acc.value))) {
+        acc = other;
+    }
+}
+
+// Finds the first maximum of start[begin, end) with respect to comp
+template <typename T, typename Compare>
+ExtremumResult<T> ArgMaxSeq(const T* start, size_t begin, size_t end, Compare comp) {
+    ExtremumResult<T> res = {T(), end, false};
+    if (begin == end) {
+        return res;
+    }
+    res.value = start[begin];
+    res.index = begin;
+    res.found = true;
+    for (size_t i = begin + 1; i < end; ++i) {
+        if (comp(res.value, start[i])) {
+            res.value = start[i];
+            res.index = i;
+        }
+    }
+    return res;
+}
+
+// Finds the first minimum and the first maximum of start[begin, end) in a single pass
+template <typename T, typename Compare>
+MinMaxResult<T> MinMaxSeq(const T* start, size_t begin, size_t end, Compare comp) {
+    MinMaxResult<T> res;
+    res.max = ArgMaxSeq(start, begin, std::min(end, begin + 1), comp);
+    res.min = res.max;
+    for (size_t i = begin + 1; i < end; ++i) {
+        if (comp(res.max.value, start[i])) {
+            res.max.value = start[i];
+            res.max.index = i;
+        } else if (comp(start[i], res.min.value)) {
+            res.min.value = start[i];
+            res.min.index = i;
+        }
+    }
+    if (begin == end) {
+        res.min.index = res.max.index = end;
+    }
+    return res;
+}
+
+#if defined(__SSE2__)
+// Vectorized kernels for doubles with the natural order. Each lane keeps its own
+// extreme together with its index (stored as a double, exact below 2^53), a lane
+// only moving on a strict improvement so that it remembers its first extreme.
+// As for the scalar version, the result is unspecified if the array contains NaNs.
+
+// Reduces the two lanes of (vals, idxs) into res, preferring the smaller index on ties
+inline void ReduceLanes(__m128d vals, __m128d idxs, bool is_max, ExtremumResult<double>& res) {
+    double v[2], id[2];
+    _mm_storeu_pd(v, vals);
+    _mm_storeu_pd(id, idxs);
+    for (size_t l = 0; l < 2; ++l) {
+        bool better = is_max ? (v[l] > res.value) : (v[l] < res.value);
+        if (better || (v[l] == res.value && (size_t) id[l] < res.index)) {
+            res.value = v[l];
+            res.index = (size_t) id[l];
+        }
+    }
+}
+
+inline ExtremumResult<double> ArgMaxSeq(const double* start, size_t begin, size_t end, std::less<double>) {
+    if (end - begin < 4) {
+        return ArgMaxSeq(start, begin, end, [](double a, double b) { return a < b; });
+    }
+    __m128d best = _mm_loadu_pd(start + begin);
+    __m128d best_idx = _mm_set_pd(begin + 1, begin);
+    __m128d idx = best_idx;
+    const __m128d step = _mm_set1_pd(2.);
+    size_t i = begin + 2;
+    for (; i + 2 <= end; i += 2) {
+        __m128d x = _mm_loadu_pd(start + i);
+        idx = _mm_add_pd(idx, step);
+        __m128d gt = _mm_cmpgt_pd(x, best);
+        best = _mm_or_pd(_mm_and_pd(gt, x), _mm_andnot_pd(gt, best));
+        best_idx = _mm_or_pd(_mm_and_pd(gt, idx), _mm_andnot_pd(gt, best_idx));
+    }
+    ExtremumResult<double> res = {start[begin], begin, true};
+    ReduceLanes(best, best_idx, true, res);
+    for (; i < end; ++i) {
+        if (start[i] > res.value) {
+            res.value = start[i];
+            res.index = i;
+        }
+    }
+    return res;
+}
+
+inline MinMaxResult<double> MinMaxSeq(const double* start, size_t begin, size_t end, std::less<double>) {
+    if (end - begin < 4) {
+        return MinMaxSeq(start, begin, end, [](double a, double b) { return a < b; });
+    }
+    __m128d hi = _mm_loadu_pd(start + begin);
+    __m128d lo = hi;
+    __m128d hi_idx = _mm_set_pd(begin + 1, begin);
+    __m128d lo_idx = hi_idx;
+    __m128d idx = hi_idx;
+    const __m128d step = _mm_set1_pd(2.);
+    size_t i = begin + 2;
+    for (; i + 2 <= end; i += 2) {
+        __m128d x = _mm_loadu_pd(start + i);
+        idx = _mm_add_pd(idx, step);
+        __m128d gt = _mm_cmpgt_pd(x, hi);
+        __m128d lt = _mm_cmplt_pd(x, lo);
+        hi = _mm_or_pd(_mm_and_pd(gt, x), _mm_andnot_pd(gt, hi));
+        hi_idx = _mm_or_pd(_mm_and_pd(gt, idx), _mm_andnot_pd(gt, hi_idx));
+        lo = _mm_or_pd(_mm_and_pd(lt, x), _mm_andnot_pd(lt, lo));
+        lo_idx = _mm_or_pd(_mm_and_pd(lt, idx), _mm_andnot_pd(lt, lo_idx));
+    }
+    MinMaxResult<double> res;
+    res.max = {start[begin], begin, true};
+    res.min = res.max;
+    ReduceLanes(hi, hi_idx, true, res.max);
+    ReduceLanes(lo, lo_idx, false, res.min);
+    for (; i < end; ++i) {
+        if (start[i] > res.max.value) {
+            res.max.value = start[i];
+            res.max.index = i;
+        }
+        if (start[i] < res.min.value) {
+            res.min.value = start[i];
+            res.min.index = i;
+        }
+    }
+    return res;
+}
+#endif
 
 /**
- * @brief Finds the maximum in the array in parallel
+ * @brief Finds the (first) maximum of the array and its position in parallel
  * @param start - pointer to the beginning of the array
  * @param N - length of the array
  * @param num_threads - the number of threads to be used
+ * @param comp - strict weak order, comp(a, b) meaning a is less than b
+ * @return the value and index of the maximum, found being false if N == 0
  */
-double MaxParallel(double* start, size_t N, size_t num_threads) {
+template <typename T, typename Compare = std::less<T>>
+ExtremumResult<T> ArgMaxParallel(const T* start, size_t N, size_t num_threads, Compare comp = Compare()) {
+    ExtremumResult<T> res = {T(), N, false};
     if (N == 0) {
-        return 0.;
+        return res;
     }
-    // Divide the array into chunks for parallel processing
-    size_t block_size = N / num_threads;
-    // Create a vector to store the maximum values found in each chunk
-    std::vector<double> max_values(num_threads, -DBL_MAX);
-    // Create a vector of threads to execute the function in parallel
-    std::vector<std::thread> workers(num_threads);
-    // Start a thread for each chunk of the array
+    num_threads = std::max<size_t>(1, std::min(num_threads, N));
+    // Each worker writes only its own padded slot, once
+    std::vector<PaddedSlot<ExtremumResult<T>>> partial(num_threads);
+    RunWorkers(num_threads, [&](size_t i) {
+        partial[i].value = ArgMaxSeq(start, ChunkBegin(N, num_threads, i), ChunkEnd(N, num_threads, i), comp);
+    });
     for (size_t i = 0; i < num_threads; ++i) {
-        workers[i] = std::thread([=, &max_values] {
-            // Compute the start and end indices of the chunk
-            size_t start_index = i * block_size;
-            size_t end_index = (i + 1) * block_size;
-            if (i == num_threads - 1) {
-                end_index = N;
-            }
-            // Find the maximum value in the chunk
-            for (size_t j = start_index; j < end_index; ++j) {
-                if (start[j] > max_values[i]) {
-                    max_values[i] = start[j];
-                }
-            }
-        });  
+        MergeArgMax(res, partial[i].value, comp);
+    }
+    return res;
+}
+
+/**
+ * @brief Finds the (first) minimum and maximum of the array and their positions in parallel
+ * @param start - pointer to the beginning of the array
+ * @param N - length of the array
+ * @param num_threads - the number of threads to be used
+ * @param comp - strict weak order, comp(a, b) meaning a is less than b
+ */
+template <typename T, typename Compare = std::less<T>>
+MinMaxResult<T> MinMaxParallel(const T* start, size_t N, size_t num_threads, Compare comp = Compare()) {
+    MinMaxResult<T> res;
+    res.min = res.max = {T(), N, false};
+    if (N == 0) {
+        return res;
     }
-    // Wait for all threads to finish executing
+    num_threads = std::max<size_t>(1, std::min(num_threads, N));
+    std::vector<PaddedSlot<MinMaxResult<T>>> partial(num_threads);
+    RunWorkers(num_threads, [&](size_t i) {
+        partial[i].value = MinMaxSeq(start, ChunkBegin(N, num_threads, i), ChunkEnd(N, num_threads, i), comp);
+    });
     for (size_t i = 0; i < num_threads; ++i) {
-        workers[i].join();
+        MergeArgMax(res.max, partial[i].value.max, comp);
+        MergeArgMin(res.min, partial[i].value.min, comp);
     }
-    // Find the maximum value in the vector of maximum values
-    return *std::max_element(max_values.begin(), max_values.end());
+    return res;
+}
+
+/**
+ * @brief Finds the maximum in the array in parallel
+ * @param start - pointer to the beginning of the array
+ * @param N - length of the array
+ * @param num_threads - the number of threads to be used
+ */
+double MaxParallel(double* start, size_t N, size_t num_threads) {
+    if (N == 0) {
+        return 0.;
+    }
+    return ArgMaxParallel(start, N, num_threads).value;
 }
 
 
@@ -99,11 +338,11 @@ void PrefixMaximums(double* start, size_t N, size_t num_threads, double* res_sta
 
     // Compute the maximums of prefixes for each chunk in a separate thread
     for (size_t i = 0; i < num_threads - 1; ++i) {
-        workers[i] = std::thread(&PartialMaxSeq, start + offset, chunk_length, res_start + offset, 0.);
+        workers[i] = std::thread(&PartialMaxSeq, start + offset, chunk_length, res_start + offset, -DBL_MAX);
         offset += chunk_length;
     }
     // Compute the maximums of prefixes for the last chunk in the main thread
-    PartialMaxSeq(start + offset, chunk_length, res_start + offset, 0.);
+    PartialMaxSeq(start + offset, chunk_length, res_start + offset, -DBL_MAX);
 
     // Wait for all the worker threads to finish
     for (size_t i = 0; i < num_threads - 1; ++i) {
@@ -135,4 +374,959 @@ void PrefixMaximums(double* start, size_t N, size_t num_threads, double* res_sta
 }
 
 
+//-----------------------------------------------------------------------------
+
+// Cursor over segment heads given as a flag array: heads[i] != 0 iff a segment starts at i
+class HeadFlags {
+        const unsigned char* heads;
+    public:
+        HeadFlags(const unsigned char* heads) : heads(heads) {}
+        bool is_head(size_t i) {
+            return heads[i] != 0;
+        }
+};
+
+// Cursor over segment heads given as the sorted start offsets of the segments.
+// Must be queried with increasing positions; empty segments are skipped.
+class HeadOffsets {
+        const size_t* cur;
+        const size_t* end;
+    public:
+        HeadOffsets(const size_t* offsets, size_t num_segments, size_t from)
+            : cur(std::lower_bound(offsets, offsets + num_segments, from)), end(offsets + num_segments) {}
+        bool is_head(size_t i) {
+            if (cur == end || *cur != i) {
+                return false;
+            }
+            while (cur != end && *cur == i) {
+                ++cur;
+            }
+            return true;
+        }
+};
+
+// Summary of a chunk after its local segmented scan
+template <typename T>
+struct SegmentChunk {
+    T last;             // scanned value at the end of the chunk
+    size_t first_head;  // first head in the chunk (end of the chunk if none)
+};
+
+// Segmented scan of start[begin, end) ignoring what precedes begin
+template <typename T, typename Cursor>
+SegmentChunk<T> SegmentedMaxSeq(const T* start, size_t begin, size_t end, Cursor heads, T* res_start) {
+    SegmentChunk<T> chunk = {std::numeric_limits<T>::lowest(), end};
+    for (size_t i = begin; i < end; ++i) {
+        if (heads.is_head(i)) {
+            if (chunk.first_head == end) {
+                chunk.first_head = i;
+            }
+            chunk.last = start[i];
+        } else if (start[i] > chunk.last) {
+            chunk.last = start[i];
+        }
+        res_start[i] = chunk.last;
+    }
+    return chunk;
+}
+
+// Same three phases as PrefixMaximums, except that a chunk only propagates
+// its carry up to its first head, and a chunk containing a head resets the carry
+template <typename T, typename MakeCursor>
+void SegmentedPrefixMaximumsImpl(const T* start, size_t N, size_t num_threads, T* res_start, MakeCursor make_cursor) {
+    if (N == 0) {
+        return;
+    }
+    num_threads = std::max<size_t>(1, std::min(num_threads, N));
+    std::vector<PaddedSlot<SegmentChunk<T>>> chunks(num_threads);
+    RunWorkers(num_threads, [&](size_t i) {
+        size_t begin = ChunkBegin(N, num_threads, i);
+        chunks[i].value = SegmentedMaxSeq(start, begin, ChunkEnd(N, num_threads, i), make_cursor(begin), res_start);
+    });
+
+    // carry[i] is the running maximum of the open segment when chunk i starts
+    std::vector<T> carry(num_threads, std::numeric_limits<T>::lowest());
+    for (size_t i = 1; i < num_threads; ++i) {
+        const SegmentChunk<T>& prev = chunks[i - 1].value;
+        bool prev_has_head = prev.first_head != ChunkEnd(N, num_threads, i - 1);
+        carry[i] = prev_has_head ? prev.last : std::max(carry[i - 1], prev.last);
+    }
+
+    RunWorkers(num_threads, [&](size_t i) {
+        size_t stop = chunks[i].value.first_head;
+        for (size_t j = ChunkBegin(N, num_threads, i); j < stop; ++j) {
+            if (res_start[j] < carry[i]) {
+                res_start[j] = carry[i];
+            }
+        }
+    });
+}
+
+/**
+ * @brief Computes the prefix maximums of every segment of the array, restarting at each head
+ * @param start - pointer to the beginning of the array
+ * @param heads - heads[i] != 0 iff a segment starts at i (position 0 always starts one)
+ * @param N - number of elements
+ * @param num_threads - number of threads to be used
+ * @param res_start - pointer to the beginning of the result array
+ */
+template <typename T>
+void SegmentedPrefixMaximums(const T* start, const unsigned char* heads, size_t N, size_t num_threads, T* res_start) {
+    SegmentedPrefixMaximumsImpl(start, N, num_threads, res_start,
+                                [heads](size_t) { return HeadFlags(heads); });
+}
+
+/**
+ * @brief Same as above, segments being given by their sorted start offsets
+ * @param offsets - offsets[k] is the index of the first element of segment k
+ * @param num_segments - length of offsets
+ */
+template <typename T>
+void SegmentedPrefixMaximums(const T* start, const size_t* offsets, size_t num_segments,
+                             size_t N, size_t num_threads, T* res_start) {
+    SegmentedPrefixMaximumsImpl(start, N, num_threads, res_start,
+                                [offsets, num_segments](size_t from) { return HeadOffsets(offsets, num_segments, from); });
+}
+
+//-----------------------------------------------------------------------------
+
+// floor(log2(x)) for x > 0
+inline size_t FloorLog2(size_t x) {
+    return 8 * sizeof(unsigned long long) - 1 - __builtin_clzll(x);
+}
+
+/**
+ * Sparse table answering max over [i, j) in O(1): level k stores the maximums
+ * of all the windows of length 2^k, and a query covers [i, j) with two
+ * (possibly overlapping) windows of the same level. Uses N log N values.
+ */
+template <typename T>
+class SparseTableMax {
+        size_t N;
+        std::vector<std::vector<T>> levels;
+    public:
+        SparseTableMax() : N(0) {}
+
+        // builds the table of start[0, N), each level being computed in parallel
+        SparseTableMax(const T* start, size_t N, size_t num_threads) : N(N) {
+            if (N == 0) {
+                return;
+            }
+            size_t num_levels = FloorLog2(N) + 1;
+            levels.resize(num_levels);
+            levels[0].assign(start, start + N);
+            for (size_t k = 1; k < num_levels; ++k) {
+                const std::vector<T>& prev = levels[k - 1];
+                std::vector<T>& cur = levels[k];
+                size_t half = size_t(1) << (k - 1);
+                size_t len = N - 2 * half + 1;
+                cur.resize(len);
+                size_t threads = UsefulThreads(num_threads, len);
+                RunWorkers(threads, [&](size_t t) {
+                    size_t end = ChunkEnd(len, threads, t);
+                    for (size_t i = ChunkBegin(len, threads, t); i < end; ++i) {
+                        cur[i] = std::max(prev[i], prev[i + half]);
+                    }
+                });
+            }
+        }
+
+        size_t size() const {return N;}
+
+        // maximum of [i, j), requires i < j <= size()
+        T query(size_t i, size_t j) const {
+            size_t k = FloorLog2(j - i);
+            const std::vector<T>& level = levels[k];
+            return std::max(level[i], level[j - (size_t(1) << k)]);
+        }
+
+        // answers the queries [lo[q], hi[q]) into out[q] in parallel
+        void query(const size_t* lo, const size_t* hi, size_t Q, T* out, size_t num_threads) const {
+            size_t threads = UsefulThreads(num_threads, Q);
+            RunWorkers(threads, [&](size_t t) {
+                size_t end = ChunkEnd(Q, threads, t);
+                for (size_t q = ChunkBegin(Q, threads, t); q < end; ++q) {
+                    out[q] = query(lo[q], hi[q]);
+                }
+            });
+        }
+
+        size_t memory_bytes() const {
+            size_t result = sizeof(*this);
+            for (const std::vector<T>& level : levels) {
+                result += level.capacity() * sizeof(T);
+            }
+            return result;
+        }
+};
+
+/**
+ * Block-decomposed variant of SparseTableMax: the array is cut into blocks of
+ * BLOCK elements, each position stores the max of its block prefix and of its
+ * block suffix, and a sparse table is built over the block maximums only.
+ * Uses about 3N + (N / BLOCK) log(N / BLOCK) values; a query that stays inside
+ * one block scans it, all other queries take O(1).
+ */
+template <typename T>
+class BlockSparseTableMax {
+        static constexpr size_t BLOCK = 32;
+        const T* data;
+        size_t N;
+        std::vector<T> prefix; // prefix[i]: max of [block start, i]
+        std::vector<T> suffix; // suffix[i]: max of [i, block end)
+        SparseTableMax<T> blocks;
+    public:
+        // the table keeps a pointer to start, which must outlive it
+        BlockSparseTableMax(const T* start, size_t N, size_t num_threads)
+            : data(start), N(N), prefix(N), suffix(N) {
+            size_t num_blocks = (N + BLOCK - 1) / BLOCK;
+            std::vector<T> block_max(num_blocks);
+            size_t threads = UsefulThreads(num_threads, N);
+            RunWorkers(threads, [&](size_t t) {
+                size_t end = ChunkEnd(num_blocks, threads, t);
+                for (size_t b = ChunkBegin(num_blocks, threads, t); b < end; ++b) {
+                    size_t lo = b * BLOCK;
+                    size_t hi = std::min(N, lo + BLOCK);
+                    prefix[lo] = start[lo];
+                    for (size_t i = lo + 1; i < hi; ++i) {
+                        prefix[i] = std::max(prefix[i - 1], start[i]);
+                    }
+                    suffix[hi - 1] = start[hi - 1];
+                    for (size_t i = hi - 1; i > lo; --i) {
+                        suffix[i - 1] = std::max(suffix[i], start[i - 1]);
+                    }
+                    block_max[b] = prefix[hi - 1];
+                }
+            });
+            blocks = SparseTableMax<T>(block_max.data(), num_blocks, num_threads);
+        }
+
+        size_t size() const {return N;}
+
+        // maximum of [i, j), requires i < j <= size()
+        T query(size_t i, size_t j) const {
+            size_t first = i / BLOCK;
+            size_t last = (j - 1) / BLOCK;
+            if (first == last) {
+                T result = data[i];
+                for (size_t k = i + 1; k < j; ++k) {
+                    result = std::max(result, data[k]);
+                }
+                return result;
+            }
+            T result = std::max(suffix[i], prefix[j - 1]);
+            if (first + 1 < last) {
+                result = std::max(result, blocks.query(first + 1, last));
+            }
+            return result;
+        }
+
+        // answers the queries [lo[q], hi[q]) into out[q] in parallel
+        void query(const size_t* lo, const size_t* hi, size_t Q, T* out, size_t num_threads) const {
+            size_t threads = UsefulThreads(num_threads, Q);
+            RunWorkers(threads, [&](size_t t) {
+                size_t end = ChunkEnd(Q, threads, t);
+                for (size_t q = ChunkBegin(Q, threads, t); q < end; ++q) {
+                    out[q] = query(lo[q], hi[q]);
+                }
+            });
+        }
+
+        // memory used on top of the indexed array
+        size_t memory_bytes() const {
+            return sizeof(*this) + (prefix.capacity() + suffix.capacity()) * sizeof(T)
+                 + blocks.memory_bytes() - sizeof(blocks);
+        }
+};
+
+//-----------------------------------------------------------------------------
+
+// Number of elements a worker buffers before reserving room for them in the output
+const size_t COMPACTION_BUFFER = 256;
+
+// The loops below are branch-free on the predicate: every element is written to
+// the current destination, which only advances when the element is kept. This is
+// what makes 50% selectivity (the worst case for branch prediction) run as fast as
+// the others. A destination is never written past the end of its own region.
+
+// Per-worker buffer of kept elements, flushed to the output by reserving room for
+// the whole buffer with a single atomic operation on a shared cursor
+template <typename T>
+struct CompactionBuffer {
+    T items[COMPACTION_BUFFER];
+    size_t size = 0;
+
+    void flush_front(T* out, std::atomic<size_t>& front) {
+        size_t pos = front.fetch_add(size);
+        std::copy(items, items + size, out + pos);
+        size = 0;
+    }
+
+    void flush_back(T* out, std::atomic<size_t>& back) {
+        size_t pos = back.fetch_sub(size) - size;
+        std::copy(items, items + size, out + pos);
+        size = 0;
+    }
+};
+
+// Counts the elements satisfying pred in every chunk, and returns in selected_before[i]
+// the exclusive prefix sum of these counts (selected_before[num_threads] being the total)
+template <typename T, typename Pred>
+void CountSelected(const T* in, size_t N, Pred pred, size_t num_threads, std::vector<size_t>& selected_before) {
+    std::vector<PaddedSlot<size_t>> counts(num_threads);
+    RunWorkers(num_threads, [&](size_t i) {
+        size_t end = ChunkEnd(N, num_threads, i);
+        size_t count = 0;
+        for (size_t j = ChunkBegin(N, num_threads, i); j < end; ++j) {
+            count += pred(in[j]) ? 1 : 0;
+        }
+        counts[i].value = count;
+    });
+    selected_before.assign(num_threads + 1, 0);
+    for (size_t i = 0; i < num_threads; ++i) {
+        selected_before[i + 1] = selected_before[i] + counts[i].value;
+    }
+}
+
+/**
+ * @brief Copies the elements of the array satisfying pred to out in parallel
+ * @param in - pointer to the beginning of the array
+ * @param N - length of the array
+ * @param out - output array, with room for N elements
+ * @param pred - predicate, evaluated up to twice per element
+ * @param num_threads - the number of threads to be used
+ * @param stable - if true, the selected elements keep their relative order (two passes
+ *                 over in: count, then write); otherwise each worker reserves room for
+ *                 its buffered elements on the fly and in is read once
+ * @return the number of elements copied
+ */
+template <typename T, typename Pred>
+size_t CopyIfParallel(const T* in, size_t N, T* out, Pred pred, size_t num_threads, bool stable = true) {
+    if (N == 0) {
+        return 0;
+    }
+    num_threads = UsefulThreads(num_threads, N);
+    if (!stable) {
+        std::atomic<size_t> front(0);
+        RunWorkers(num_threads, [&](size_t i) {
+            std::unique_ptr<CompactionBuffer<T>> buffer(new CompactionBuffer<T>());
+            size_t end = ChunkEnd(N, num_threads, i);
+            for (size_t j = ChunkBegin(N, num_threads, i); j < end; ++j) {
+                buffer->items[buffer->size] = in[j];
+                buffer->size += pred(in[j]) ? 1 : 0;
+                if (buffer->size == COMPACTION_BUFFER) {
+                    buffer->flush_front(out, front);
+                }
+            }
+            buffer->flush_front(out, front);
+        });
+        return front.load();
+    }
+
+    std::vector<size_t> selected_before;
+    CountSelected(in, N, pred, num_threads, selected_before);
+    RunWorkers(num_threads, [&](size_t i) {
+        T* dest = out + selected_before[i];
+        T* limit = out + selected_before[i + 1];
+        size_t end = ChunkEnd(N, num_threads, i);
+        for (size_t j = ChunkBegin(N, num_threads, i); j < end && dest != limit; ++j) {
+            *dest = in[j];
+            dest += pred(in[j]) ? 1 : 0;
+        }
+    });
+    return selected_before[num_threads];
+}
+
+/**
+ * @brief Partitions the array into out in parallel: the elements satisfying pred
+ *        first, then the others
+ * @param in - pointer to the beginning of the array
+ * @param N - length of the array
+ * @param out - output array of length N
+ * @param pred - predicate, evaluated up to twice per element
+ * @param num_threads - the number of threads to be used
+ * @param stable - if true, both parts keep the relative order of the input
+ * @return the number of elements satisfying pred
+ */
+template <typename T, typename Pred>
+size_t PartitionParallel(const T* in, size_t N, T* out, Pred pred, size_t num_threads, bool stable = true) {
+    if (N == 0) {
+        return 0;
+    }
+    num_threads = UsefulThreads(num_threads, N);
+    if (!stable) {
+        std::atomic<size_t> front(0);
+        std::atomic<size_t> back(N);
+        RunWorkers(num_threads, [&](size_t i) {
+            std::unique_ptr<CompactionBuffer<T>> selected(new CompactionBuffer<T>());
+            std::unique_ptr<CompactionBuffer<T>> rejected(new CompactionBuffer<T>());
+            size_t end = ChunkEnd(N, num_threads, i);
+            for (size_t j = ChunkBegin(N, num_threads, i); j < end; ++j) {
+                size_t keep = pred(in[j]) ? 1 : 0;
+                selected->items[selected->size] = in[j];
+                rejected->items[rejected->size] = in[j];
+                selected->size += keep;
+                rejected->size += 1 - keep;
+                if (selected->size == COMPACTION_BUFFER) {
+                    selected->flush_front(out, front);
+                }
+                if (rejected->size == COMPACTION_BUFFER) {
+                    rejected->flush_back(out, back);
+                }
+            }
+            selected->flush_front(out, front);
+            rejected->flush_back(out, back);
+        });
+        return front.load();
+    }
+
+    std::vector<size_t> selected_before;
+    CountSelected(in, N, pred, num_threads, selected_before);
+    size_t total = selected_before[num_threads];
+    RunWorkers(num_threads, [&](size_t i) {
+        size_t begin = ChunkBegin(N, num_threads, i);
+        size_t end = ChunkEnd(N, num_threads, i);
+        T* dest_selected = out + selected_before[i];
+        T* limit_selected = out + selected_before[i + 1];
+        T* dest_rejected = out + total + (begin - selected_before[i]);
+        T* limit_rejected = out + total + (end - selected_before[i + 1]);
+        size_t j = begin;
+        for (; j < end && dest_selected != limit_selected && dest_rejected != limit_rejected; ++j) {
+            size_t keep = pred(in[j]) ? 1 : 0;
+            *dest_selected = in[j];
+            *dest_rejected = in[j];
+            dest_selected += keep;
+            dest_rejected += 1 - keep;
+        }
+        // only one kind of element is left in the chunk
+        std::copy(in + j, in + end, (dest_selected != limit_selected) ? dest_selected : dest_rejected);
+    });
+    return total;
+}
+
+//-----------------------------------------------------------------------------
+
+// Maps the keys supported by RadixSortParallel to unsigned integers with the same order
+template <typename T>
+struct RadixKey;
+
+template <>
+struct RadixKey<uint32_t> {
+    typedef uint32_t Bits;
+    static Bits bits(uint32_t x) {return x;}
+};
+
+template <>
+struct RadixKey<uint64_t> {
+    typedef uint64_t Bits;
+    static Bits bits(uint64_t x) {return x;}
+};
+
+// two's complement: flipping the sign bit puts negative numbers first
+template <>
+struct RadixKey<int32_t> {
+    typedef uint32_t Bits;
+    static Bits bits(int32_t x) {return uint32_t(x) ^ 0x80000000u;}
+};
+
+template <>
+struct RadixKey<int64_t> {
+    typedef uint64_t Bits;
+    static Bits bits(int64_t x) {return uint64_t(x) ^ 0x8000000000000000ull;}
+};
+
+// IEEE 754: positive numbers only need their sign bit set, negative numbers are
+// stored as magnitudes and need all their bits flipped. NaNs end up at both ends.
+template <>
+struct RadixKey<float> {
+    typedef uint32_t Bits;
+    static Bits bits(float x) {
+        uint32_t u;
+        std::memcpy(&u, &x, sizeof(u));
+        return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+    }
+};
+
+template <>
+struct RadixKey<double> {
+    typedef uint64_t Bits;
+    static Bits bits(double x) {
+        uint64_t u;
+        std::memcpy(&u, &x, sizeof(u));
+        return (u & 0x8000000000000000ull) ? ~u : (u | 0x8000000000000000ull);
+    }
+};
+
+const size_t RADIX_BITS = 8;
+const size_t RADIX_BUCKETS = size_t(1) << RADIX_BITS;
+
+// One digit histogram per worker, padded so that workers never share a line
+struct alignas(CACHE_LINE_SIZE) RadixHistogram {
+    size_t count[RADIX_BUCKETS];
+};
+
+/**
+ * @brief Sorts keys[0, N) in parallel with an LSD radix sort on 8-bit digits,
+ *        carrying values[0, N) along if values is not null. The sort is stable.
+ * @param keys - uint32_t, uint64_t, int32_t, int64_t, float or double keys
+ * @param values - payload permuted together with the keys, or nullptr
+ * @param N - number of keys
+ * @param num_threads - number of threads to be used
+ *
+ * Every pass builds per-worker digit histograms, exclusive-scans them in
+ * (digit, worker) order to get the first output position of each worker for each
+ * digit, and lets every worker scatter its chunk. Passes on a digit that is the
+ * same for all keys are skipped.
+ */
+template <typename T, typename V>
+void RadixSortParallel(T* keys, V* values, size_t N, size_t num_threads) {
+    typedef typename RadixKey<T>::Bits Bits;
+    if (N <= 1) {
+        return;
+    }
+    num_threads = UsefulThreads(num_threads, N);
+    std::vector<T> keys_tmp(N);
+    std::vector<V> values_tmp(values != nullptr ? N : 0);
+    T* src = keys;
+    T* dst = keys_tmp.data();
+    V* src_values = values;
+    V* dst_values = values_tmp.data();
+    std::vector<RadixHistogram> histograms(num_threads);
+
+    for (size_t shift = 0; shift < 8 * sizeof(Bits); shift += RADIX_BITS) {
+        RunWorkers(num_threads, [&](size_t t) {
+            size_t* count = histograms[t].count;
+            std::fill(count, count + RADIX_BUCKETS, 0);
+            size_t end = ChunkEnd(N, num_threads, t);
+            for (size_t i = ChunkBegin(N, num_threads, t); i < end; ++i) {
+                ++count[(RadixKey<T>::bits(src[i]) >> shift) & (RADIX_BUCKETS - 1)];
+            }
+        });
+
+        // turn the counts into starting positions, skipping the pass if one digit has everything
+        bool trivial = false;
+        size_t position = 0;
+        for (size_t d = 0; d < RADIX_BUCKETS; ++d) {
+            size_t digit_total = 0;
+            for (size_t t = 0; t < num_threads; ++t) {
+                size_t c = histograms[t].count[d];
+                histograms[t].count[d] = position;
+                position += c;
+                digit_total += c;
+            }
+            if (digit_total == N) {
+                trivial = true;
+                break;
+            }
+        }
+        if (trivial) {
+            continue;
+        }
+
+        RunWorkers(num_threads, [&](size_t t) {
+            size_t* next = histograms[t].count;
+            size_t end = ChunkEnd(N, num_threads, t);
+            for (size_t i = ChunkBegin(N, num_threads, t); i < end; ++i) {
+                size_t pos = next[(RadixKey<T>::bits(src[i]) >> shift) & (RADIX_BUCKETS - 1)]++;
+                dst[pos] = src[i];
+                if (src_values != nullptr) {
+                    dst_values[pos] = src_values[i];
+                }
+            }
+        });
+        std::swap(src, dst);
+        std::swap(src_values, dst_values);
+    }
+
+    // after an odd number of effective passes the result lives in the temporary buffers
+    if (src != keys) {
+        RunWorkers(num_threads, [&](size_t t) {
+            size_t begin = ChunkBegin(N, num_threads, t);
+            size_t end = ChunkEnd(N, num_threads, t);
+            std::copy(src + begin, src + end, keys + begin);
+            if (values != nullptr) {
+                std::copy(src_values + begin, src_values + end, values + begin);
+            }
+        });
+    }
+}
+
+/**
+ * @brief Sorts keys[0, N) in parallel, see above
+ */
+template <typename T>
+void RadixSortParallel(T* keys, size_t N, size_t num_threads) {
+    RadixSortParallel(keys, static_cast<uint32_t*>(nullptr), N, num_threads);
+}
+
+/**
+ * @brief Sorts keys[0, N) in parallel and returns in perm the permutation applied:
+ *        perm[i] is the original position of the key now at position i
+ */
+template <typename T>
+void RadixSortParallel(T* keys, size_t N, size_t num_threads, std::vector<size_t>& perm) {
+    perm.resize(N);
+    std::iota(perm.begin(), perm.end(), 0);
+    RadixSortParallel(keys, perm.data(), N, num_threads);
+}
+
+//-----------------------------------------------------------------------------
+
+// Cursor for a single segment starting at 0
+class SingleSegment {
+    public:
+        bool is_head(size_t i) {
+            return i == 0;
+        }
+};
+
+// Whether a batch of rows is better processed one row per thread (short rows, or
+// enough rows to keep every thread busy) than by splitting each row between threads
+inline bool BatchAcrossRows(size_t rows, size_t cols, size_t num_threads) {
+    return rows >= num_threads || UsefulThreads(num_threads, cols) == 1;
+}
+
+/**
+ * @brief Computes the prefix maximums of every row of a row-major matrix
+ * @param start - pointer to the first element of the matrix
+ * @param rows - number of rows
+ * @param cols - number of columns
+ * @param stride - distance (in elements) between the beginnings of two consecutive rows
+ * @param num_threads - number of threads to be used
+ * @param res_start - pointer to the result matrix, with the same stride
+ *
+ * Threads are spawned once for the whole batch if its rows are short or numerous,
+ * rows being distributed between them; otherwise every row is split between them,
+ * and threads are spawned twice for the batch, once per phase.
+ */
+void BatchedPrefixMaximums(const double* start, size_t rows, size_t cols, size_t stride,
+                           size_t num_threads, double* res_start) {
+    if (rows == 0 || cols == 0) {
+        return;
+    }
+    if (!BatchAcrossRows(rows, cols, num_threads)) {
+        // the two phases of SegmentedPrefixMaximumsImpl, each one over every row; a
+        // single segment has its only head at 0, so that the carry of a chunk is the
+        // maximum of the chunks before it
+        num_threads = UsefulThreads(num_threads, cols);
+        std::vector<PaddedSlot<SegmentChunk<double>>> chunks(rows * num_threads);
+        RunWorkers(num_threads, [&](size_t t) {
+            size_t begin = ChunkBegin(cols, num_threads, t);
+            size_t end = ChunkEnd(cols, num_threads, t);
+            for (size_t r = 0; r < rows; ++r) {
+                chunks[r * num_threads + t].value = SegmentedMaxSeq(start + r * stride, begin, end, SingleSegment(),
+                                                                    res_start + r * stride);
+            }
+        });
+        std::vector<double> carry(rows * num_threads, std::numeric_limits<double>::lowest());
+        for (size_t r = 0; r < rows; ++r) {
+            for (size_t t = 1; t < num_threads; ++t) {
+                carry[r * num_threads + t] = std::max(carry[r * num_threads + t - 1],
+                                                      chunks[r * num_threads + t - 1].value.last);
+            }
+        }
+        RunWorkers(num_threads, [&](size_t t) {
+            size_t end = ChunkEnd(cols, num_threads, t);
+            for (size_t r = 0; t > 0 && r < rows; ++r) {
+                double* res = res_start + r * stride;
+                double c = carry[r * num_threads + t];
+                for (size_t j = ChunkBegin(cols, num_threads, t); j < end; ++j) {
+                    if (res[j] < c) {
+                        res[j] = c;
+                    }
+                }
+            }
+        });
+        return;
+    }
+    num_threads = std::min(rows, UsefulThreads(num_threads, rows * cols));
+    RunWorkers(num_threads, [&](size_t t) {
+        size_t end = ChunkEnd(rows, num_threads, t);
+        for (size_t r = ChunkBegin(rows, num_threads, t); r < end; ++r) {
+            SegmentedMaxSeq(start + r * stride, 0, cols, SingleSegment(), res_start + r * stride);
+        }
+    });
+}
+
+/**
+ * @brief Finds the maximum of every row of a row-major matrix
+ * @param start - pointer to the first element of the matrix
+ * @param rows - number of rows
+ * @param cols - number of columns
+ * @param stride - distance (in elements) between the beginnings of two consecutive rows
+ * @param num_threads - number of threads to be used
+ * @param res - res[r] receives the maximum of row r (0 if cols == 0, as for MaxParallel)
+ */
+void BatchedMaxParallel(const double* start, size_t rows, size_t cols, size_t stride,
+                        size_t num_threads, double* res) {
+    if (rows == 0) {
+        return;
+    }
+    if (cols == 0) {
+        std::fill(res, res + rows, 0.);
+        return;
+    }
+    if (!BatchAcrossRows(rows, cols, num_threads)) {
+        for (size_t r = 0; r < rows; ++r) {
+            res[r] = ArgMaxParallel(start + r * stride, cols, num_threads).value;
+        }
+        return;
+    }
+    num_threads = std::min(rows, UsefulThreads(num_threads, rows * cols));
+    RunWorkers(num_threads, [&](size_t t) {
+        size_t end = ChunkEnd(rows, num_threads, t);
+        for (size_t r = ChunkBegin(rows, num_threads, t); r < end; ++r) {
+            res[r] = ArgMaxSeq(start + r * stride, 0, cols, std::less<double>()).value;
+        }
+    });
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * van Herk / Gil-Werman sliding-window extremum. The array is cut into blocks of W
+ * elements; h[i] is the extremum from i up to the end of its block, g[i] the one from
+ * the start of its block up to i. A window [i, i + W) starting in block b ends in
+ * block b + 1 and its extremum is the best of h[i] and g[i + W - 1]: 3 comparisons
+ * per element whatever W, and every block is independent, hence trivially parallel.
+ */
+
+// Fills res_start[i] for the windows starting in the blocks [first_block, last_block).
+// g of the next block is computed on the fly, h in the buffer suffix (W values).
+template <typename T, typename Better>
+void VanHerkBlocks(const T* start, size_t N, size_t W, size_t first_block, size_t last_block,
+                   T* res_start, Better better, std::vector<T>& suffix) {
+    size_t num_windows = N - W + 1;
+    for (size_t b = first_block; b < last_block; ++b) {
+        size_t lo = b * W;
+        size_t hi = std::min(N, lo + W);
+        suffix[hi - 1 - lo] = start[hi - 1];
+        for (size_t i = hi - 1; i > lo; --i) {
+            const T& next = suffix[i - lo];
+            suffix[i - 1 - lo] = better(start[i - 1], next) ? start[i - 1] : next;
+        }
+        res_start[lo] = suffix[0];
+        T g = T();
+        for (size_t k = 1; k < W && lo + k < num_windows; ++k) {
+            const T& x = start[lo + W + k - 1];
+            g = (k == 1 || better(x, g)) ? x : g;
+            res_start[lo + k] = better(g, suffix[k]) ? g : suffix[k];
+        }
+    }
+}
+
+/**
+ * @brief Computes the extremum of every window of W consecutive elements in parallel
+ * @param start - pointer to the beginning of the array
+ * @param N - length of the array
+ * @param W - window length, 1 <= W <= N
+ * @param num_threads - number of threads to be used
+ * @param res_start - res_start[i] receives the extremum of start[i, i + W), i < N - W + 1
+ * @param better - better(a, b) is true if a should be preferred to b (std::greater for max)
+ */
+template <typename T, typename Better>
+void SlidingWindowParallel(const T* start, size_t N, size_t W, size_t num_threads, T* res_start, Better better) {
+    if (W == 0 || W > N) {
+        return;
+    }
+    size_t num_windows = N - W + 1;
+    size_t num_blocks = (num_windows + W - 1) / W;
+    size_t threads = std::min(num_blocks, UsefulThreads(num_threads, N));
+    RunWorkers(threads, [&](size_t t) {
+        std::vector<T> suffix(W);
+        VanHerkBlocks(start, N, W, ChunkBegin(num_blocks, threads, t), ChunkEnd(num_blocks, threads, t),
+                      res_start, better, suffix);
+    });
+}
+
+template <typename T>
+void SlidingWindowMax(const T* start, size_t N, size_t W, size_t num_threads, T* res_start) {
+    SlidingWindowParallel(start, N, W, num_threads, res_start, std::greater<T>());
+}
+
+template <typename T>
+void SlidingWindowMin(const T* start, size_t N, size_t W, size_t num_threads, T* res_start) {
+    SlidingWindowParallel(start, N, W, num_threads, res_start, std::less<T>());
+}
+
+/**
+ * Streaming form of the sliding-window extremum: values are appended one at a time
+ * and the extremum of the last W values is available after every append. Uses the
+ * same decomposition with a ring of two blocks, so that every operation is O(1)
+ * amortized and the memory is 2W values: h is recomputed for a whole block at once
+ * when it is completed. A window of W = 0 values is never full, push ignores the values.
+ */
+template <typename T, typename Better>
+class SlidingWindowStream {
+        size_t W;
+        Better better;
+        std::vector<T> block;     // values of the block being filled
+        T g;                      // extremum of block
+        std::vector<T> suffix;    // h of the last completed block
+        size_t count;             // number of values appended so far
+    public:
+        SlidingWindowStream(size_t W, Better better = Better())
+            : W(W), better(better), g(), count(0) {
+            block.reserve(W);
+        }
+
+        void push(const T& value) {
+            if (W == 0) {
+                return;
+            }
+            if (block.size() == W) {
+                // the block is complete: compute its suffix extremums and start a new one
+                suffix.assign(block.begin(), block.end());
+                for (size_t i = W - 1; i > 0; --i) {
+                    if (better(suffix[i], suffix[i - 1])) {
+                        suffix[i - 1] = suffix[i];
+                    }
+                }
+                block.clear();
+            }
+            g = (block.empty() || better(value, g)) ? value : g;
+            block.push_back(value);
+            ++count;
+        }
+
+        // true once W values have been appended, never for W = 0
+        bool full() const {return W > 0 && count >= W;}
+
+        // extremum of the last min(W, count) values, requires count > 0
+        T current() const {
+            if (block.size() == W || suffix.empty()) {
+                return g;
+            }
+            // the window starts in the previous block, at index block.size() of it
+            const T& a = suffix[block.size()];
+            return better(g, a) ? g : a;
+        }
+};
+
+//-----------------------------------------------------------------------------
+
+// Maximum as a binary functor, to be used like std::plus
+template <typename T>
+struct Max {
+    T operator()(const T& a, const T& b) const {
+        return (a < b) ? b : a;
+    }
+};
+
+// dst[j] = op(src[j], dst[j]) for j in [0, n)
+template <typename T, typename Op>
+void CombineRows(T* dst, const T* src, size_t n, Op op) {
+    for (size_t j = 0; j < n; ++j) {
+        dst[j] = op(src[j], dst[j]);
+    }
+}
+
+#if defined(__SSE2__)
+inline void CombineRows(double* dst, const double* src, size_t n, std::plus<double>) {
+    size_t j = 0;
+    for (; j + 2 <= n; j += 2) {
+        _mm_storeu_pd(dst + j, _mm_add_pd(_mm_loadu_pd(src + j), _mm_loadu_pd(dst + j)));
+    }
+    for (; j < n; ++j) {
+        dst[j] += src[j];
+    }
+}
+
+inline void CombineRows(double* dst, const double* src, size_t n, Max<double>) {
+    size_t j = 0;
+    for (; j + 2 <= n; j += 2) {
+        _mm_storeu_pd(dst + j, _mm_max_pd(_mm_loadu_pd(src + j), _mm_loadu_pd(dst + j)));
+    }
+    for (; j < n; ++j) {
+        dst[j] = std::max(src[j], dst[j]);
+    }
+}
+#endif
+
+// Width (in elements) of the column strips of the vertical pass: a strip of two
+// rows stays in L1 while a thread walks down its strip
+const size_t GRID_STRIP = 512;
+
+/**
+ * @brief Computes the 2D prefix aggregate of a row-major grid in parallel:
+ *        res[r][c] = op over all start[i][j] with i <= r and j <= c
+ * @param start - pointer to the first element of the grid
+ * @param rows - number of rows
+ * @param cols - number of columns
+ * @param stride - distance (in elements) between the beginnings of two consecutive rows,
+ *                 for both start and res_start
+ * @param num_threads - number of threads to be used
+ * @param res_start - pointer to the result grid (may be equal to start)
+ * @param op - associative and commutative operation (std::plus, Max)
+ *
+ * The horizontal pass scans every row (rows are distributed between threads), the
+ * vertical pass combines each row with the one above it, threads owning strips of
+ * GRID_STRIP columns, so that both passes only read contiguous memory.
+ */
+template <typename T, typename Op>
+void PrefixGridParallel(const T* start, size_t rows, size_t cols, size_t stride,
+                        size_t num_threads, T* res_start, Op op) {
+    if (rows == 0 || cols == 0) {
+        return;
+    }
+    size_t threads = std::min(rows, UsefulThreads(num_threads, rows * cols));
+    RunWorkers(threads, [&](size_t t) {
+        size_t end = ChunkEnd(rows, threads, t);
+        for (size_t r = ChunkBegin(rows, threads, t); r < end; ++r) {
+            const T* in = start + r * stride;
+            T* out = res_start + r * stride;
+            T acc = in[0];
+            out[0] = acc;
+            for (size_t c = 1; c < cols; ++c) {
+                acc = op(acc, in[c]);
+                out[c] = acc;
+            }
+        }
+    });
+
+    size_t num_strips = (cols + GRID_STRIP - 1) / GRID_STRIP;
+    threads = std::min(num_strips, UsefulThreads(num_threads, rows * cols));
+    RunWorkers(threads, [&](size_t t) {
+        size_t first = ChunkBegin(num_strips, threads, t) * GRID_STRIP;
+        size_t last = std::min(cols, ChunkEnd(num_strips, threads, t) * GRID_STRIP);
+        for (size_t c = first; c < last; c += GRID_STRIP) {
+            size_t width = std::min(GRID_STRIP, last - c);
+            for (size_t r = 1; r < rows; ++r) {
+                CombineRows(res_start + r * stride + c, res_start + (r - 1) * stride + c, width, op);
+            }
+        }
+    });
+}
+
+// Summed-area table: res[r][c] is the sum of start[0..r][0..c]
+inline void SummedAreaTable(const double* start, size_t rows, size_t cols, size_t stride,
+                            size_t num_threads, double* res_start) {
+    PrefixGridParallel(start, rows, cols, stride, num_threads, res_start, std::plus<double>());
+}
+
+// 2D prefix maximums: res[r][c] is the maximum of start[0..r][0..c]
+template <typename T>
+void PrefixMaximums2D(const T* start, size_t rows, size_t cols, size_t stride,
+                      size_t num_threads, T* res_start) {
+    PrefixGridParallel(start, rows, cols, stride, num_threads, res_start, Max<T>());
+}
+
+// Sum of the box [r0, r1) x [c0, c1) read from a summed-area table, in O(1)
+inline double BoxSum(const double* sat, size_t stride, size_t r0, size_t c0, size_t r1, size_t c1) {
+    if (r0 >= r1 || c0 >= c1) {
+        return 0.;
+    }
+    double result = sat[(r1 - 1) * stride + (c1 - 1)];
+    if (r0 > 0) {
+        result -= sat[(r0 - 1) * stride + (c1 - 1)];
+    }
+    if (c0 > 0) {
+        result -= sat[(r1 - 1) * stride + (c0 - 1)];
+    }
+    if (r0 > 0 && c0 > 0) {
+        result += sat[(r0 - 1) * stride + (c0 - 1)];
+    }
+    return result;
+}
+
 //-----------------------------------------------------------------------------
@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "td3.cpp"
+
+// Workload on Account: every thread does N operations, a read (get_amount) with
+// probability read_fraction, otherwise a transfer (80%), a withdrawal (10%) or a
+// deposit (10%), on accounts picked uniformly or with a zipf(1) distribution.
+
+const unsigned int INITIAL_MONEY = 1000000;
+
+// Picks account indices in [0, M) with the given distribution
+class AccountPicker {
+        std::vector<double> cdf;  // empty for uniform
+        size_t M;
+    public:
+        AccountPicker(size_t M, bool zipf) : M(M) {
+            if (zipf) {
+                cdf.resize(M);
+                double sum = 0.;
+                for (size_t a = 0; a < M; ++a) {
+                    sum += 1. / (a + 1);
+                    cdf[a] = sum;
+                }
+            }
+        }
+
+        size_t pick(unsigned int& seed) const {
+            if (cdf.empty()) {
+                return rand_r(&seed) % M;
+            }
+            double u = cdf.back() * rand_r(&seed) / RAND_MAX;
+            return std::min<size_t>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), M - 1);
+        }
+};
+
+// One operation of the workload, generated before the run so that the measured loop
+// only does the operations
+struct Operation {
+    enum Kind : uint32_t { READ, TRANSFER, WITHDRAW, ADD };
+    uint32_t kind;
+    uint32_t a;
+    uint32_t b;
+    uint32_t amount;
+};
+
+// the N operations of a thread
+std::vector<Operation> generate_operations(size_t M, size_t N, const AccountPicker& picker, double read_fraction, unsigned int seed) {
+    std::vector<Operation> operations(N);
+    unsigned int read_threshold = read_fraction * RAND_MAX;
+    for (Operation& o : operations) {
+        unsigned int kind = rand_r(&seed);
+        o.a = picker.pick(seed);
+        o.b = picker.pick(seed);
+        if (o.b == o.a) {
+            o.b = (o.a + 1) % M;
+        }
+        o.amount = 1 + rand_r(&seed) % 100;
+        unsigned int op = rand_r(&seed) % 10;
+        o.kind = (kind < read_threshold) ? Operation::READ
+               : (op < 8) ? Operation::TRANSFER : (op == 8) ? Operation::WITHDRAW : Operation::ADD;
+    }
+    return operations;
+}
+
+struct WorkloadResult {
+    double ops_per_second;
+    long long p50, p99, p999;  // latency of an operation in nanoseconds
+    bool conserved;            // final total = initial total + deposits - withdrawals
+};
+
+WorkloadResult run_workload(size_t M, size_t num_threads, size_t N, const AccountPicker& picker, double read_fraction) {
+    AccountArray accounts(M, INITIAL_MONEY);
+    std::vector<std::vector<unsigned int>> latencies(num_threads, std::vector<unsigned int>(N));
+    // net money added by deposits and withdrawals of each thread
+    std::vector<long long> net(num_threads, 0);
+    // sum of the balances read, shared with the threads so that reads are not optimized away
+    std::vector<unsigned long long> seen(num_threads, 0);
+    std::vector<std::vector<Operation>> operations(num_threads);
+    for (size_t t = 0; t < num_threads; ++t) {
+        operations[t] = generate_operations(M, N, picker, read_fraction, t + 1);
+    }
+
+    auto work = [&](size_t t) {
+        for (size_t i = 0; i < N; ++i) {
+            const Operation& o = operations[t][i];
+            auto start = std::chrono::steady_clock::now();
+            switch (o.kind) {
+                case Operation::READ:
+                    seen[t] += accounts[o.a].get_amount();
+                    break;
+                case Operation::TRANSFER:
+                    Account::transfer(o.amount, accounts[o.a], accounts[o.b]);
+                    break;
+                case Operation::WITHDRAW:
+                    if (accounts[o.a].withdraw(o.amount)) {
+                        net[t] -= o.amount;
+                    }
+                    break;
+                default:
+                    accounts[o.a].add(o.amount);
+                    net[t] += o.amount;
+            }
+            auto finish = std::chrono::steady_clock::now();
+            latencies[t][i] = std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count();
+        }
+    };
+
+    std::vector<std::thread> workers(num_threads - 1);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t t = 0; t < num_threads - 1; ++t) {
+        workers[t] = std::thread(work, t);
+    }
+    work(num_threads - 1);
+    for (size_t t = 0; t < num_threads - 1; ++t) {
+        workers[t].join();
+    }
+    auto finish = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(finish - start).count();
+
+    WorkloadResult result;
+    result.ops_per_second = num_threads * N / seconds;
+    std::vector<unsigned int> all;
+    for (auto& l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    auto quantile = [&all](double q) {
+        auto it = all.begin() + std::min(all.size() - 1, (size_t) (q * all.size()));
+        std::nth_element(all.begin(), it, all.end());
+        return (long long) *it;
+    };
+    result.p50 = quantile(0.5);
+    result.p99 = quantile(0.99);
+    result.p999 = quantile(0.999);
+
+    long long expected = (long long) M * INITIAL_MONEY;
+    for (size_t t = 0; t < num_threads; ++t) {
+        expected += net[t];
+    }
+    long long total = 0;
+    for (size_t a = 0; a < M; ++a) {
+        total += accounts[a].get_amount();
+    }
+    result.conserved = (total == expected);
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 6) {
+        std::cout << "Usage: ./account_benchmarker num_accounts max_threads ops_per_thread uniform|zipf read_fraction [results.csv]" << std::endl;
+        std::cout << "  runs the workload for 1, 2, 4, ... max_threads threads" << std::endl;
+        return 0;
+    }
+
+    size_t M = std::stoul(argv[1]);
+    size_t max_threads = std::stoul(argv[2]);
+    size_t N = std::stoul(argv[3]);
+    std::string distribution = argv[4];
+    double read_fraction = std::stod(argv[5]);
+    if (M < 2 || M > UINT_MAX || (distribution != "uniform" && distribution != "zipf")) {
+        std::cout << "need 2 to 2^32 - 1 accounts, and a uniform or zipf distribution" << std::endl;
+        return 1;
+    }
+    std::ofstream csv;
+    if (argc > 6) {
+        // the header is written only to a new file, so that runs can be appended
+        bool exists = std::ifstream(argv[6]).good();
+        csv.open(argv[6], std::ios::app);
+        if (!exists) {
+            csv << "accounts,threads,ops_per_thread,distribution,read_fraction,ops_per_second,p50_ns,p99_ns,p999_ns,conserved" << std::endl;
+        }
+    }
+
+    AccountPicker picker(M, distribution == "zipf");
+    std::cout << "threads, million operations per second, latency p50, p99, p999 (nanoseconds), money conserved" << std::endl;
+    bool all_conserved = true;
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        WorkloadResult r = run_workload(M, threads, N, picker, read_fraction);
+        all_conserved = all_conserved && r.conserved;
+        std::cout << threads << " " << r.ops_per_second / 1e6 << " " << r.p50 << " " << r.p99 << " "
+                  << r.p999 << " " << (r.conserved ? "yes" : "NO") << std::endl;
+        if (csv.is_open()) {
+            csv << M << "," << threads << "," << N << "," << distribution << "," << read_fraction << ","
+                << r.ops_per_second << "," << r.p50 << "," << r.p99 << "," << r.p999 << ","
+                << (r.conserved ? 1 : 0) << std::endl;
+        }
+    }
+    return all_conserved ? 0 : 1;
+}
+
+/*
+
+SPACE TO REPORT AND ANALYZE THE RUNTIMES
+
+The operations of every thread are generated before the clock starts, so the
+throughput counts only the operations and the clock reads around them.
+
+./account_benchmarker 10000 64 200000 uniform 0.2 results.csv
+threads, million operations per second, latency p50, p99, p999 (nanoseconds), money conserved
+1 7.08695 88 234 397 yes
+2 6.05706 100 238 387 yes
+4 6.96863 98 185 339 yes
+8 6.87193 98 164 340 yes
+16 6.33856 100 183 361 yes
+32 6.96548 94 212 432 yes
+64 7.17597 90 234 602 yes
+
+./account_benchmarker 10000 64 200000 zipf 0.2 results.csv
+1 8.62854 69 269 440 yes
+2 6.79463 93 346 702 yes
+4 8.40777 80 205 373 yes
+8 7.81257 82 224 394 yes
+16 7.46336 87 229 423 yes
+32 6.21577 102 267 458 yes
+64 6.08946 102 280 493 yes
+
+./account_benchmarker 10000 64 200000 zipf 0.95 results.csv
+1 9.03593 51 228 402 yes
+2 9.29304 48 251 406 yes
+4 11.3869 40 200 356 yes
+8 10.7076 39 186 346 yes
+16 9.31011 48 204 364 yes
+32 9.45756 50 160 284 yes
+64 11.5642 39 152 293 yes
+
+Latencies include about 25ns of clock reads. With the accounts picked inside
+the timed loop, the zipf runs looked twice slower than the uniform ones (about
+3.9 against 7.5 million operations per second): the binary search of the
+picker, two per operation, cost more than the operation. Measuring the
+operations alone, zipf is as fast as uniform or slightly faster, its hot
+accounts staying in cache, and the difference with the thread count is within
+the noise of this machine. On one core the threads never wait for each other:
+a transfer takes 90ns whatever the number of threads, and the p999 only shows
+the rare operations interrupted by the scheduler. Money was conserved in every
+run.
+
+Read-heavy mix (95% reads), after get_amount became a sequence lock read:
+
+./account_benchmarker 10000 64 200000 uniform 0.95
+1 9.39195 52 203 353 yes
+2 12.0012 43 153 288 yes
+4 11.2629 44 155 304 yes
+8 8.65244 54 176 341 yes
+16 8.92572 48 172 327 yes
+32 9.08398 54 168 296 yes
+64 9.102 55 159 272 yes
+
+./account_benchmarker 10000 16 200000 zipf 0.95 (accounts still picked inside the timed loop)
+         sequence lock               unsynchronized read (before)
+1 3.70558 43 263 419 yes        1 4.09289 37 215 367 yes
+2 3.70134 40 243 408 yes        2 4.0466 38 203 349 yes
+4 3.75887 41 253 422 yes        4 3.99896 38 225 393 yes
+8 3.27649 50 281 447 yes        8 3.92724 39 235 407 yes
+16 3.98712 40 213 380 yes       16 3.49324 44 280 458 yes
+
+./account_benchmarker 10 64 200000 uniform 0.95 (10 accounts, each written constantly)
+1 13.3939 36 82 84 yes
+2 10.6884 35 107 228 yes
+4 12.8751 35 97 199 yes
+8 10.6021 46 124 275 yes
+16 12.1945 36 109 192 yes
+32 13.244 34 94 145 yes
+64 12.9971 35 97 157 yes
+
+A read now loads the version twice around the balance, and every write stores
+the version twice. On x86 the fences only constrain the compiler, so a median
+operation costs about 3ns more than with the racy load it replaces (37 to 40ns
+with the clock reads), within the noise of the uniform runs. Readers never take
+the lock, so they never delay a writer. On one core a reader only finds a write
+in progress when the writer was preempted between its two version stores, and
+then yields rather than spinning. Even with 10 accounts under constant writes,
+the read-heavy mix keeps its throughput.
+
+*/
@@ -0,0 +1,932 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "td3.cpp"
+
+// Returns the running time of f in microseconds
+template <typename F>
+long time_us(F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto finish = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(finish - start).count();
+}
+
+//-----------------------------------------------------------------------------
+
+// FindThread before batching: one atomic load per element and one atomic increment per hit
+template <typename T>
+void FindThreadShared(T* arr, size_t block_size, T target, unsigned int count, std::atomic<unsigned int>& occurences) {
+    T* end = arr + block_size;
+    while (arr != end) {
+        if (occurences >= count) {
+            return;
+        }
+        if (*arr == target) {
+            occurences += 1;
+        }
+        ++arr;
+    }
+}
+
+template <typename T, typename Thread>
+bool FindParallelWith(Thread thread, T* arr, size_t N, T target, size_t count, size_t num_threads) {
+    std::atomic<unsigned int> occurences(0);
+    size_t block_size = N / num_threads;
+    std::vector<std::thread> workers(num_threads - 1);
+    for (size_t i = 0; i < num_threads - 1; ++i) {
+        workers[i] = std::thread(thread, arr + i * block_size, block_size, target, count, std::ref(occurences));
+    }
+    thread(arr + (num_threads - 1) * block_size, N - (num_threads - 1) * block_size, target, count, occurences);
+    for (size_t i = 0; i < num_threads - 1; ++i) {
+        workers[i].join();
+    }
+    return occurences >= count;
+}
+
+// Full scans (count is never reached) for target frequencies from 0.001% to 50%
+void benchmark_find(size_t num_threads, size_t N) {
+    std::vector<int> values(N);
+    double frequencies[] = {0.00001, 0.001, 0.1, 0.5};
+    for (double frequency : frequencies) {
+        int modulus = (int) (1 / frequency);
+        for (size_t i = 0; i < N; ++i) {
+            values[i] = rand() % modulus;
+        }
+        long shared = time_us([&] {
+            FindParallelWith(&FindThreadShared<int>, values.data(), N, 0, N + 1, num_threads);
+        });
+        long batched = time_us([&] {
+            FindParallel<int>(values.data(), N, 0, N + 1, num_threads);
+        });
+        std::cout << frequency * 100 << "% " << shared << " " << batched << std::endl;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+// Full scans with 1 to 64 targets: one FindParallel call per target against a single FindAnyParallel
+void benchmark_find_any(size_t num_threads, size_t N) {
+    std::vector<int> values(N);
+    for (size_t i = 0; i < N; ++i) {
+        values[i] = rand() % 1000;
+    }
+    size_t sizes[] = {1, 4, 16, 64};
+    for (size_t k : sizes) {
+        std::vector<int> targets(k);
+        for (size_t t = 0; t < k; ++t) {
+            targets[t] = t;
+        }
+        long per_target = time_us([&] {
+            for (size_t t = 0; t < k; ++t) {
+                FindParallel<int>(values.data(), N, targets[t], N + 1, num_threads);
+            }
+        });
+        long any = time_us([&] {
+            FindAnyParallel<int>(values.data(), N, targets, N + 1, num_threads);
+        });
+        std::cout << k << " " << per_target << " " << any << std::endl;
+    }
+}
+
+// Cost of one pass of the FindAnyParallel kernels over N values in [0, 1000), one
+// thread, for 1 to 16 targets: broadcast compares against the table lookup, with
+// contiguous targets (0..k-1, direct table) and sparse ones (random ints, hash table
+// past one target), to place MAX_BROADCAST_TARGETS
+void benchmark_broadcast(size_t num_threads, size_t N) {
+#if defined(__SSE2__)
+    std::vector<int> values(N);
+    for (size_t i = 0; i < N; ++i) {
+        values[i] = rand() % 1000;
+    }
+    std::vector<unsigned int> found(16);
+    for (size_t k = 1; k <= 16; ++k) {
+        std::vector<int> contiguous(k), sparse(k);
+        for (size_t t = 0; t < k; ++t) {
+            contiguous[t] = t;
+            sparse[t] = rand();
+        }
+        TargetTable<int> direct(contiguous), hashed(sparse);
+        long broadcast = time_us([&] {
+            CountTargetsBroadcast<16>(values.data(), values.data() + N, sparse, found.data());
+        });
+        long lookup_direct = time_us([&] {
+            CountTargetsLookup(values.data(), values.data() + N, direct, found.data());
+        });
+        long lookup_hashed = time_us([&] {
+            CountTargetsLookup(values.data(), values.data() + N, hashed, found.data());
+        });
+        std::cout << k << " " << broadcast << " " << lookup_direct << " " << lookup_hashed << std::endl;
+    }
+#else
+    std::cout << "needs SSE2" << std::endl;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+
+// Searches a memory-mapped file of N random letters with a pattern planted every
+// megabyte: counting all its occurrences, then looking for the first occurrence of
+// a pattern which is absent
+void benchmark_grep(size_t num_threads, size_t N) {
+    const std::string pattern = "ERROR: connection reset";
+    std::string contents(N, ' ');
+    for (size_t i = 0; i < N; ++i) {
+        contents[i] = 'a' + rand() % 26;
+    }
+    for (size_t i = 1000000; i + pattern.size() < N; i += 1000000) {
+        contents.replace(i, pattern.size(), pattern);
+    }
+    std::string path = "benchmark_grep.tmp";
+    FILE* f = fopen(path.c_str(), "wb");
+    fwrite(contents.data(), 1, contents.size(), f);
+    fclose(f);
+    {
+        MappedFile file(path);
+        if (!file.is_open()) {
+            std::cout << "Could not map " << path << std::endl;
+            return;
+        }
+        const char* buf = file.data();
+        size_t size = file.size();
+        auto gbs = [size](long us) { return (double) size / std::max(us, 1L) / 1000.; };
+
+        size_t serial_count = 0, parallel_count = 0;
+        long serial = time_us([&] {
+            const char* pos = buf;
+            const char* end = buf + size;
+            while ((pos = (const char*) memmem(pos, end - pos, pattern.data(), pattern.size())) != nullptr) {
+                ++serial_count;
+                ++pos;
+            }
+        });
+        long parallel = time_us([&] {
+            parallel_count = CountPatternParallel(buf, size, pattern.data(), pattern.size(), num_threads);
+        });
+        std::cout << "count(" << serial_count << "/" << parallel_count << ") " << gbs(serial) << " " << gbs(parallel) << std::endl;
+
+        // a pattern that never occurs: both searches have to read the whole file
+        const std::string absent = "connection refused";
+        const char* serial_first = nullptr;
+        size_t parallel_first = 0;
+        long serial_time = time_us([&] { serial_first = (const char*) memmem(buf, size, absent.data(), absent.size()); });
+        long parallel_time = time_us([&] {
+            parallel_first = FindFirstPatternParallel(buf, size, absent.data(), absent.size(), num_threads);
+        });
+        std::cout << "first(" << (serial_first != nullptr) << "/" << (parallel_first != size) << ") "
+                  << gbs(serial_time) << " " << gbs(parallel_time) << std::endl;
+    }
+    remove(path.c_str());
+}
+
+//-----------------------------------------------------------------------------
+
+// Measures the constants of FrequencyCostModel and the break-even number of queries
+void benchmark_index(size_t num_threads, size_t N) {
+    std::vector<int> values(N);
+    for (size_t i = 0; i < N; ++i) {
+        values[i] = rand() % 100000;
+    }
+    size_t Q = 20;
+    long scan = time_us([&] {
+        for (size_t q = 0; q < Q; ++q) {
+            FindParallel<int>(values.data(), N, rand() % 100000, N + 1, num_threads);
+        }
+    });
+    FrequencyIndex<int>* index = nullptr;
+    long build = time_us([&] { index = new FrequencyIndex<int>(values.data(), N, num_threads); });
+    size_t QI = 1000000;
+    size_t checksum = 0;
+    long query = time_us([&] {
+        for (size_t q = 0; q < QI; ++q) {
+            checksum += index->count(rand() % 100000);
+        }
+    });
+    double scan_per_element = 1000. * scan * num_threads / Q / N;
+    double build_per_element = 1000. * build * num_threads / N;
+    double query_ns = 1000. * query / QI;
+    std::cout << "scan " << scan_per_element << " build " << build_per_element << " query " << query_ns
+              << " (memory " << (double) index->memory_bytes() / N << " bytes per element, checksum " << checksum << ")" << std::endl;
+    FrequencyCostModel model;
+    size_t break_even = 1;
+    while (!model.worth_indexing(N, break_even, num_threads)) {
+        break_even *= 2;
+    }
+    std::cout << "model: index pays off from about " << break_even << " queries; measured: "
+              << (long) (build / (1. * scan / Q - query / 1000. / QI * 1000.)) << std::endl;
+    delete index;
+}
+
+//-----------------------------------------------------------------------------
+
+// Runs op(thread index, iteration) N times on each of num_threads threads and returns
+// the throughput in millions of operations per second
+template <typename Op>
+double throughput(size_t num_threads, size_t N, Op op) {
+    std::vector<std::thread> workers(num_threads);
+    long us = time_us([&] {
+        for (size_t t = 0; t < num_threads; ++t) {
+            workers[t] = std::thread([&op, t, N] {
+                for (size_t i = 0; i < N; ++i) {
+                    op(t, i);
+                }
+            });
+        }
+        for (size_t t = 0; t < num_threads; ++t) {
+            workers[t].join();
+        }
+    });
+    return (double) num_threads * N / std::max(us, 1L);
+}
+
+// All threads hit the same account (withdraw, add) or the same pair of accounts
+// in both directions (transfer), for 1 to num_threads threads
+template <typename AccountType>
+std::vector<double> account_throughputs(size_t threads, size_t N) {
+    std::vector<double> result;
+    AccountType a(1u << 30), b(1u << 30);
+    result.push_back(throughput(threads, N, [&](size_t, size_t) { a.withdraw(1); }));
+    result.push_back(throughput(threads, N, [&](size_t, size_t) { a.add(1); }));
+    result.push_back(throughput(threads, N, [&](size_t t, size_t) {
+        if (t % 2 == 0) {
+            AccountType::transfer(1, a, b);
+        } else {
+            AccountType::transfer(1, b, a);
+        }
+    }));
+    return result;
+}
+
+void benchmark_accounts(size_t num_threads, size_t N) {
+    const char* names[] = {"withdraw", "add", "transfer"};
+    for (size_t threads = 1; threads <= num_threads; threads *= 2) {
+        std::vector<double> locked = account_throughputs<Account>(threads, N);
+        std::vector<double> atomic = account_throughputs<AtomicAccount>(threads, N);
+        for (size_t k = 0; k < locked.size(); ++k) {
+            std::cout << threads << " " << names[k] << " " << locked[k] << " " << atomic[k] << std::endl;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+// N transfers between 10^5 accounts, a growing share of them involving account 0
+void benchmark_batch(size_t num_threads, size_t N) {
+    size_t M = 100000;
+    double hot_shares[] = {0., 0.01, 0.1, 0.5};
+    for (double hot : hot_shares) {
+        std::vector<std::unique_ptr<Account>> owned;
+        std::vector<Account*> accounts;
+        for (size_t a = 0; a < M; ++a) {
+            owned.emplace_back(new Account(1000));
+            accounts.push_back(owned.back().get());
+        }
+        std::vector<Transfer> batch(N);
+        for (size_t k = 0; k < N; ++k) {
+            batch[k].amount = 1 + rand() % 10;
+            batch[k].from = ((double) rand() / RAND_MAX < hot) ? 0 : rand() % M;
+            batch[k].to = rand() % M;
+            if (batch[k].to == batch[k].from) {
+                batch[k].to = (batch[k].to + 1) % M;
+            }
+        }
+        long sequential = time_us([&] {
+            for (const Transfer& tr : batch) {
+                Account::transfer(tr.amount, *accounts[tr.from], *accounts[tr.to]);
+            }
+        });
+        BatchTransferEngine engine(accounts, num_threads);
+        long batched = time_us([&] { engine.apply(batch); });
+        std::cout << hot << " " << (double) N / std::max(sequential, 1L) << " "
+                  << (double) N / std::max(batched, 1L) << std::endl;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+// Transactions of 8 legs over 1000 accounts, one of them (the fee account) in every
+// transaction, for 1 to num_threads threads running N transactions each
+void benchmark_transactions(size_t num_threads, size_t N) {
+    size_t M = 1000;
+    std::vector<std::unique_ptr<Account>> accounts;
+    for (size_t a = 0; a < M; ++a) {
+        accounts.emplace_back(new Account(1000000));
+    }
+    for (size_t threads = 1; threads <= num_threads; threads *= 2) {
+        std::vector<long long> held(threads, 0), attempts(threads, 0);
+        std::vector<std::thread> workers(threads);
+        long us = time_us([&] {
+            for (size_t t = 0; t < threads; ++t) {
+                workers[t] = std::thread([&, t] {
+                    unsigned int seed = t;
+                    for (size_t k = 0; k < N; ++k) {
+                        Transaction tr;
+                        tr.push_back({accounts[0].get(), 7});
+                        long long total = 7;
+                        for (size_t leg = 0; leg < 6; ++leg) {
+                            long long amount = rand_r(&seed) % 10;
+                            tr.push_back({accounts[1 + rand_r(&seed) % (M - 1)].get(), amount});
+                            total += amount;
+                        }
+                        tr.push_back({accounts[1 + rand_r(&seed) % (M - 1)].get(), -total});
+                        TransactionReport report = Account::apply(tr);
+                        held[t] += report.held.count();
+                        attempts[t] += report.attempts;
+                    }
+                });
+            }
+            for (size_t t = 0; t < threads; ++t) {
+                workers[t].join();
+            }
+        });
+        double count = (double) threads * N;
+        std::cout << threads << " " << 1000. * count / std::max(us, 1L) << " "
+                  << std::accumulate(held.begin(), held.end(), 0LL) / count << " "
+                  << std::accumulate(attempts.begin(), attempts.end(), 0LL) / count << std::endl;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+// Transfers between 10^4 accounts, uniform or with every transfer leaving from the
+// same hot account, for 1 to num_threads client threads doing N transfers each.
+// The sharded store is timed until flush returns, i.e. until every transfer is applied.
+void benchmark_sharded(size_t num_threads, size_t N) {
+    size_t M = 10000;
+    const char* loads[] = {"uniform", "hot"};
+    for (size_t threads = 1; threads <= num_threads; threads *= 4) {
+        for (size_t load = 0; load < 2; ++load) {
+            std::vector<std::vector<Transfer>> work(threads, std::vector<Transfer>(N));
+            for (size_t t = 0; t < threads; ++t) {
+                unsigned int seed = t;
+                for (Transfer& tr : work[t]) {
+                    tr.amount = 1 + rand_r(&seed) % 10;
+                    tr.from = load ? 0 : rand_r(&seed) % M;
+                    tr.to = 1 + rand_r(&seed) % (M - 1);
+                    if (tr.to == tr.from) {
+                        tr.to = tr.to % (M - 1) + 1;
+                    }
+                }
+            }
+            std::vector<std::unique_ptr<Account>> accounts;
+            for (size_t a = 0; a < M; ++a) {
+                accounts.emplace_back(new Account(1000000));
+            }
+            double locked = throughput(threads, N, [&](size_t t, size_t i) {
+                const Transfer& tr = work[t][i];
+                Account::transfer(tr.amount, *accounts[tr.from], *accounts[tr.to]);
+            });
+            ShardedAccountStore store(M, 1000000, 4);
+            long us = time_us([&] {
+                throughput(threads, N, [&](size_t t, size_t i) {
+                    const Transfer& tr = work[t][i];
+                    store.transfer_async(tr.amount, tr.from, tr.to);
+                });
+                store.flush();
+            });
+            std::cout << threads << " " << loads[load] << " " << locked << " "
+                      << (double) threads * N / std::max(us, 1L) << std::endl;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+// Account creation on 1 to num_threads threads creating N accounts each: one by one
+// (ids from per-thread blocks), by arrays of 1000, and for reference the former
+// scheme of one fetch_add on a shared counter per id
+void benchmark_ids(size_t num_threads, size_t N) {
+    for (size_t threads = 1; threads <= num_threads; threads *= 4) {
+        std::vector<unsigned long long> sums(threads, 0);
+        double single = throughput(threads, N, [&](size_t t, size_t i) {
+            Account a(1);
+            sums[t] += a.get_id();
+        });
+        double bulk = throughput(threads, N / 1000, [&](size_t t, size_t i) {
+            AccountArray accounts(1000, 1);
+            sums[t] += accounts[999].get_id();
+        }) * 1000;
+        std::atomic<unsigned int> counter(0);
+        double shared = throughput(threads, N, [&](size_t t, size_t i) {
+            sums[t] += counter.fetch_add(1);
+        });
+        std::cout << threads << " " << single << " " << bulk << " " << shared
+                  << " (" << std::accumulate(sums.begin(), sums.end(), 0ULL) % 10 << ")" << std::endl;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+// Uniform transfers between 10^5 accounts on 1 to num_threads threads doing N transfers
+// each, alone and while another thread takes snapshots (with 2 threads) in a loop
+void benchmark_snapshot(size_t num_threads, size_t N) {
+    size_t M = 100000;
+    AccountArray owned(M, 1000);
+    std::vector<Account*> accounts;
+    for (size_t i = 0; i < M; ++i) {
+        accounts.push_back(&owned[i]);
+    }
+    auto transfers = [&](size_t t, size_t i) {
+        size_t from = (t * 7919 + i * 104729) % M;
+        size_t to = (from + 1 + i % (M - 1)) % M;
+        Account::transfer(1, *accounts[from], *accounts[to]);
+    };
+    for (size_t threads = 1; threads <= num_threads; threads *= 4) {
+        double alone = throughput(threads, N, transfers);
+        std::atomic<bool> stop(false);
+        size_t snapshots = 0;
+        size_t inconsistent = 0;
+        std::thread auditor([&] {
+            while (!stop.load()) {
+                inconsistent += (Account::snapshot_total(accounts, 2) != 1000 * M);
+                ++snapshots;
+            }
+        });
+        long us = time_us([&] {
+            throughput(threads, N, transfers);
+        });
+        stop.store(true);
+        auditor.join();
+        std::cout << threads << " " << alone << " " << (double) threads * N / std::max(us, 1L) << " "
+                  << 1e6 * snapshots / std::max(us, 1L) << " (" << inconsistent << " inconsistent)" << std::endl;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+// num_threads threads doing N durable transfers each between 1000 accounts, for group
+// commits of at most 1, 4, ..., 4096 records (log in the current directory)
+void benchmark_durable(size_t num_threads, size_t N) {
+    const std::string path = "benchmark_durable.log";
+    size_t M = 1000;
+    for (size_t max_batch = 1; max_batch <= 4096; max_batch *= 4) {
+        unlink(path.c_str());
+        DurableAccounts accounts(path, M, max_batch);
+        if (!accounts.is_open()) {
+            std::cout << "cannot open " << path << std::endl;
+            return;
+        }
+        throughput(num_threads, M / num_threads + 1, [&](size_t t, size_t i) {
+            accounts.add((t * (M / num_threads + 1) + i) % M, 1000000);
+        });
+        uint64_t commits = accounts.commits();
+        double rate = throughput(num_threads, N, [&](size_t t, size_t i) {
+            size_t from = (t * 7919 + i * 104729) % M;
+            accounts.transfer(1, from, (from + 1 + i % (M - 1)) % M);
+        });
+        std::cout << max_batch << " " << 1000 * rate << " "
+                  << (double) num_threads * N / (accounts.commits() - commits) << std::endl;
+    }
+    unlink(path.c_str());
+}
+
+//-----------------------------------------------------------------------------
+
+// Transfers between 10^4 accounts picked with a zipf(1) distribution (1% of the accounts
+// take part in about 60% of the transfers), for 1 to num_threads threads doing N each:
+// with flat combining disabled, with hot accounts detected, and with the top 1% made hot
+void benchmark_combining(size_t num_threads, size_t N) {
+    size_t M = 10000;
+    std::vector<double> cdf(M);
+    double sum = 0.;
+    for (size_t a = 0; a < M; ++a) {
+        sum += 1. / (a + 1);
+        cdf[a] = sum;
+    }
+    for (size_t threads = 1; threads <= num_threads; threads *= 4) {
+        std::vector<std::vector<Transfer>> work(threads, std::vector<Transfer>(N));
+        for (size_t t = 0; t < threads; ++t) {
+            unsigned int seed = t;
+            auto zipf = [&]() {
+                double u = sum * rand_r(&seed) / RAND_MAX;
+                return (size_t) std::min<ptrdiff_t>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), M - 1);
+            };
+            for (Transfer& tr : work[t]) {
+                tr.amount = 1;
+                tr.from = zipf();
+                tr.to = zipf();
+                if (tr.to == tr.from) {
+                    tr.to = (tr.to + 1) % M;
+                }
+            }
+        }
+        std::cout << threads;
+        size_t detected = 0;
+        for (size_t mode = 0; mode < 3; ++mode) {
+            Account::set_hot_threshold(mode == 1 ? 1000 : 0);
+            AccountArray accounts(M, 1000000);
+            if (mode == 2) {
+                for (size_t a = 0; a < M / 100; ++a) {
+                    accounts[a].make_hot();
+                }
+            }
+            std::cout << " " << throughput(threads, N, [&](size_t t, size_t i) {
+                const Transfer& tr = work[t][i];
+                Account::transfer(tr.amount, accounts[tr.from], accounts[tr.to]);
+            });
+            if (mode == 1) {
+                for (size_t a = 0; a < M; ++a) {
+                    detected += accounts[a].is_hot();
+                }
+            }
+        }
+        std::cout << " " << detected << std::endl;
+    }
+    Account::set_hot_threshold(0);
+}
+
+//-----------------------------------------------------------------------------
+
+// N accounts as an AccountArray and as an AccountTable: bytes per account, uniform
+// transfers on num_threads threads, and full scans (total, 1% interest)
+void benchmark_table(size_t num_threads, size_t N) {
+    AccountArray accounts(N, 1000);
+    AccountTable table(N, 1000);
+    std::cout << "bytes per account " << sizeof(Account) << " " << (double) table.memory_bytes() / N << std::endl;
+
+    auto pick = [N](size_t t, size_t i) {
+        size_t from = (t * 7919 + i * 104729) % N;
+        return std::make_pair(from, (from + 1 + i % (N - 1)) % N);
+    };
+    double objects = throughput(num_threads, N / num_threads, [&](size_t t, size_t i) {
+        auto p = pick(t, i);
+        Account::transfer(1, accounts[p.first], accounts[p.second]);
+    });
+    double columns = throughput(num_threads, N / num_threads, [&](size_t t, size_t i) {
+        auto p = pick(t, i);
+        table.transfer(1, p.first, p.second);
+    });
+    std::cout << "transfers (millions per second) " << objects << " " << columns << std::endl;
+
+    unsigned long long sum_objects = 0, sum_table = 0;
+    long us_objects = time_us([&] {
+        for (size_t i = 0; i < N; ++i) {
+            sum_objects += accounts[i].get_amount();
+        }
+    });
+    long us_table = time_us([&] { sum_table = table.total(num_threads); });
+    std::cout << "total (ms) " << us_objects / 1000. << " " << us_table / 1000. << std::endl;
+    if (sum_objects != sum_table) {
+        std::cout << "different totals " << sum_objects << " " << sum_table << std::endl;
+    }
+
+    us_objects = time_us([&] {
+        for (size_t i = 0; i < N; ++i) {
+            accounts[i].add(accounts[i].get_amount() / 100);
+        }
+    });
+    us_table = time_us([&] { table.accrue_interest(0.01, num_threads); });
+    std::cout << "interest (ms) " << us_objects / 1000. << " " << us_table / 1000. << std::endl;
+}
+
+//-----------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        std::cout << "Usage: ./benchmarker benchmark num_threads N" << std::endl;
+        std::cout << "  benchmark is one of: find, find_any, broadcast, grep, index, accounts, batch, transactions, sharded, ids, snapshot, durable, combining, table" << std::endl;
+        return 0;
+    }
+
+    std::string benchmark = argv[1];
+    size_t num_threads = std::stoul(argv[2]);
+    size_t N = std::stoul(argv[3]);
+
+    if (benchmark == "find") {
+        std::cout << "target frequency, shared counter, batched counter (microseconds)" << std::endl;
+        benchmark_find(num_threads, N);
+    } else if (benchmark == "find_any") {
+        std::cout << "number of targets, FindParallel per target, FindAnyParallel (microseconds)" << std::endl;
+        benchmark_find_any(num_threads, N);
+    } else if (benchmark == "broadcast") {
+        std::cout << "number of targets, broadcast compares, direct table, hash table (microseconds)" << std::endl;
+        benchmark_broadcast(num_threads, N);
+    } else if (benchmark == "grep") {
+        std::cout << "search, memmem (GB/s), parallel (GB/s)" << std::endl;
+        benchmark_grep(num_threads, N);
+    } else if (benchmark == "index") {
+        std::cout << "measured costs per element or query (nanoseconds, one thread), then queries needed to pay off the index" << std::endl;
+        benchmark_index(num_threads, N);
+    } else if (benchmark == "accounts") {
+        std::cout << "threads, operation, Account, AtomicAccount (million operations per second)" << std::endl;
+        benchmark_accounts(num_threads, N);
+    } else if (benchmark == "batch") {
+        std::cout << "share of transfers on the hot account, sequential Account::transfer, BatchTransferEngine (million transfers per second)" << std::endl;
+        benchmark_batch(num_threads, N);
+    } else if (benchmark == "transactions") {
+        std::cout << "threads, transactions per second (thousands), average lock hold (ns), average try rounds" << std::endl;
+        benchmark_transactions(num_threads, N);
+    } else if (benchmark == "sharded") {
+        std::cout << "threads, load, Account, ShardedAccountStore with 4 shards (million transfers per second)" << std::endl;
+        benchmark_sharded(num_threads, N);
+    } else if (benchmark == "ids") {
+        std::cout << "threads, Account constructions, AccountArray of 1000 (million accounts per second), shared fetch_add(1) (million ids per second)" << std::endl;
+        benchmark_ids(num_threads, N);
+    } else if (benchmark == "snapshot") {
+        std::cout << "threads, transfers alone, transfers during snapshots (million per second), snapshots per second" << std::endl;
+        benchmark_snapshot(num_threads, N);
+    } else if (benchmark == "durable") {
+        std::cout << "max records per commit, durable transfers per second (thousands), average records per commit" << std::endl;
+        benchmark_durable(num_threads, N);
+    } else if (benchmark == "combining") {
+        std::cout << "threads, plain mutex, hot accounts detected, top 1% hot (million transfers per second), hot accounts detected" << std::endl;
+        benchmark_combining(num_threads, N);
+    } else if (benchmark == "table") {
+        std::cout << "measure, AccountArray, AccountTable" << std::endl;
+        benchmark_table(num_threads, N);
+    } else {
+        std::cout << "Unknown benchmark " << benchmark << std::endl;
+        return 1;
+    }
+#ifdef LOCK_STATS
+    DumpLockStats(std::cout);
+#endif
+}
+
+/*
+
+SPACE TO REPORT AND ANALYZE THE RUNTIMES
+
+./benchmarker find 4 50000000 (full scans, count is never reached)
+target frequency, shared counter, batched counter (microseconds)
+0.001% 55066 48998
+0.1% 58176 57799
+10% 142057 52963
+50% 409910 59291
+
+With the batched counter the scan costs the same whatever the frequency of the
+target, whereas the per-hit atomic increment makes it 7x slower at 50%, and
+this on one core only, without any cache-line ping-pong between cores.
+
+./benchmarker find_any 4 50000000 (full scans, targets 0..k-1 among values in [0, 1000))
+number of targets, FindParallel per target, FindAnyParallel (microseconds)
+1 49332 36770
+4 187890 55205
+16 772675 58232
+64 3223779 102584
+
+One scan instead of k. Up to 4 targets the SSE2 broadcast compares cost about
+one extra scan per 4 targets; past that the direct-indexed table (the targets
+span a small range) costs a single load per element whatever the number of targets.
+
+./benchmarker broadcast 1 50000000 (one pass of each kernel, values in [0, 1000))
+number of targets, broadcast compares, direct table, hash table (microseconds)
+1 41618 63977 51225
+2 42647 53917 590643
+3 48256 50576 531359
+4 60739 61748 522792
+5 90671 81074 327038
+6 98311 57409 408233
+7 92503 60187 502236
+8 106729 50566 696460
+9 101364 56988 277664
+10 123870 70845 408673
+11 136218 65212 475713
+12 164927 75971 516333
+13 206553 76368 561494
+14 188994 55673 615348
+15 158156 56207 630366
+16 177630 58144 668457
+
+The limit of 8 broadcast targets had been picked on contiguous targets, where
+the alternative is the direct table. Against it the broadcast compares only
+win up to 4 targets (they are even at 4, the table wins by 1.5-2x from 6 on),
+hence MAX_BROADCAST_DIRECT = 4. Sparse targets (random ints) go to the hash
+table instead, which costs 6 to 14ns per element: std::hash<int> is the
+identity, so values probe clusters of slots, and the branch on a hit is
+unpredictable. From 9 to 16 targets the broadcast compares stay 2.5 to 5x
+faster (100 to 200us against 280 to 670us per million values), hence
+MAX_BROADCAST_TARGETS = 16 for hashed targets; a second run gave the same
+ordering at every k.
+
+./benchmarker grep 4 500000000 (a 500MB memory-mapped file)
+search, memmem (GB/s), parallel (GB/s)
+count(499/499) 4.39499 4.93413
+first(0/0) 4.37825 4.20829
+
+On one core the SSE2 first/last byte filter is on par with glibc's memmem,
+which is itself vectorized; the parallel version scales with the number of
+cores from there until the page cache bandwidth is reached.
+
+./benchmarker index 1 10000000 (values in [0, 100000))
+measured costs per element or query (nanoseconds, one thread), then queries needed to pay off the index
+scan 1.02077 build 109.613 query 176.915 (memory 0.157286 bytes per element, checksum 100016433)
+model: index pays off from about 128 queries; measured: 107
+
+Building the index costs about a hundred scans, after which every query is a
+binary search over the distinct values (180ns, cache misses included) instead
+of a full scan (10ms here). FrequencyCostModel uses these constants, the sort
+cost growing as log N.
+
+./benchmarker accounts 64 200000 (one hot account, or one hot pair for transfers)
+threads, operation, Account, AtomicAccount (million operations per second)
+1 withdraw 33.5064 57.0125
+1 add 34.8797 57.0613
+1 transfer 19.3536 14.8511
+4 withdraw 42.0632 65.2688
+4 add 44.9666 63.1912
+4 transfer 23.1054 17.276
+16 withdraw 40.1581 58.9026
+16 add 37.7052 62.5586
+16 transfer 20.3249 15.8253
+64 withdraw 39.3142 56.4095
+64 add 39.9948 57.5529
+64 transfer 19.1832 16.0219
+
+On this single-core machine the threads never actually contend, so the numbers
+only show the cost of an uncontended operation: a CAS withdrawal or deposit is
+about 1.5x cheaper than lock + update + unlock (a deposit was 3x cheaper as a
+plain fetch_add, given up to reject balances past UINT_MAX). A transfer is a
+two-word compare-and-swap: write the descriptor, install it in both accounts,
+decide it and put values back, seven atomic operations against four for the
+two mutexes of Account, so it is about 20% slower. A first version, a
+withdrawal followed by a deposit, ran at 50 million per second but let readers
+see the amount on neither account; a second one locked both accounts with a
+bit in their words but made readers wait for it. With real cores the mutex
+version additionally pays futex sleeps and wake-ups under contention, while no
+operation on AtomicAccount ever waits: a thread running into a transfer
+completes it.
+
+./benchmarker batch 4 5000000 (10^5 accounts)
+share of transfers on the hot account, sequential Account::transfer, BatchTransferEngine (million transfers per second)
+0 14.6124 15.9035
+0.01 10.4431 12.098
+0.1 11.3611 13.7888
+0.5 10.8575 13.0851
+
+On one core the engine already beats the sequential loop, as it takes no lock;
+the wave scheduling costs about as much as the locks it saves. With 50% of the
+transfers on the hot account the waves are all small and collapse into serial
+steps, so the engine degrades to a lock-free sequential loop instead of paying
+a barrier per wave.
+
+./benchmarker transactions 64 20000 (8 legs over 1000 accounts, one fee account in every transaction)
+threads, transactions per second (thousands), average lock hold (ns), average try rounds
+1 1343.91 150.964 1
+2 1440.04 147.427 1.00005
+4 1380.21 147.312 1.00008
+8 1397.17 251.654 1.00035
+16 1352.09 215.385 1.00063
+32 1397.54 200.93 1.0007
+64 1721.81 861.425 1.00083
+
+The 8 locks are held for about 150ns, spent validating the balances and applying
+the deltas; the hold time grows with the thread count only because the
+scheduler preempts threads while they hold the locks (single core). Less than
+0.1% of the transactions need a second try round, and none reached the
+blocking fallback, even with every transaction sharing the fee account.
+
+./benchmarker sharded 64 100000 (10^4 accounts)
+threads, load, Account, ShardedAccountStore with 4 shards (million transfers per second)
+1 uniform 15.3022 6.23986
+1 hot 18.1951 6.52401
+4 uniform 15.348 4.38823
+4 hot 23.0601 8.25474
+16 uniform 20.103 3.16023
+16 hot 20.0645 5.43235
+64 uniform 15.1611 2.54026
+64 hot 20.2907 5.8723
+
+With a single core the mutexes of Account are never contended, so the store
+only shows its own costs: an allocation and two atomic exchanges per message,
+and a second message for the 3/4 of the transfers whose destination is in
+another shard. Hot loads do better as all debits hit one cached balance. The uniform throughput drops with the client count as
+the shards get fewer time slices. The gain is expected with real cores, where
+the hot account serializes Account::transfer on one contended mutex while its
+shard applies debits back to back from its own cache.
+
+make clean && make benchmarker LOCK_STATS=1 && ./benchmarker accounts 4 200000
+threads, operation, Account, AtomicAccount (million operations per second)
+1 withdraw 8.16693 63.5526
+1 transfer 5.08233 24.7341
+2 withdraw 8.85818 66.313
+2 transfer 5.08835 26.6613
+4 withdraw 8.74556 65.9304
+4 transfer 3.94436 24.5829
+Account::lock: 5600182 attempts, 364 contended (0.00649979%)
+  wait p50 < 4194304ns, p99 < 16777216ns
+  hold p50 < 64ns, p99 < 256ns
+
+Only 364 attempts in 5.6 million find the lock taken, each time because the
+holder was preempted: the waiter then sleeps for a time slice (4ms), while a
+lock is normally held for less than 64ns. So on one core the latency of
+Account::transfer comes from the scheduler, not from the lock. The timing costs
+two clock reads per acquisition, which divides the Account throughput by 5 on
+this machine; without LOCK_STATS the lock is a plain std::mutex and the
+numbers are those of the accounts mode above.
+
+./benchmarker transactions 8 20000 with LOCK_STATS gives 168 contended in 2.4
+million attempts (0.007%), failed try_lock of Account::apply; in one run out of
+two, a single blocking lock also had to wait (for 8us).
+
+./benchmarker ids 64 10000000 (last column: checksum of the ids, printed so that nothing is optimized away)
+threads, Account constructions, AccountArray of 1000 (million accounts per second), shared fetch_add(1) (million ids per second)
+1 379.737 564.717 92.8023 (0)
+4 366.818 531.413 98.89 (0)
+16 367.589 575.807 93.5087 (6)
+64 357.068 531.116 89.2533 (8)
+
+A locked instruction on the shared counter alone (about 10ns, uncontended)
+costs 4 times a whole construction with per-thread blocks, where the counter
+is touched once per 1024 accounts. On several cores the shared line would also
+bounce between them, which the blocks avoid too. Arrays reserve their ids in
+one fetch_add and allocate once.
+
+./benchmarker snapshot 64 1000000 (10^5 accounts)
+threads, transfers alone, transfers during snapshots (million per second), snapshots per second
+1 8.21268 4.42515 287.635 (0 inconsistent)
+4 10.4523 10.0239 80.1911 (0 inconsistent)
+16 12.9857 10.3756 18.8057 (0 inconsistent)
+64 10.3566 7.83172 4.28297 (0 inconsistent)
+
+This benchmark only runs transfers, so it only checks them; SnapshotTotal_test
+also mixes in transactions and withdrawals. An operation loads the epoch once,
+with the locks of all its accounts held, and saves all of them against it: when
+each account loaded the epoch itself, a snapshot starting between the two loads
+split a transfer, and that test failed in 2 runs out of 3. Outside snapshots,
+the epoch check costs nothing measurable: a sequential loop of 2*10^7 transfers
+runs at 19-31 million per second before and after the change (the spread is
+noise of this machine). With a single core, the two snapshot threads take the
+CPU from the transfer threads in proportion to their number, hence the drop
+with 1 transfer thread; with 16 threads the transfers lose 20%: the copy of the
+balances changed during each snapshot, and the lock of the auditor on each
+account.
+
+./benchmarker durable 64 200 (log on the local ext4 disk)
+max records per commit, durable transfers per second (thousands), average records per commit
+1 4.12691 1
+4 15.2214 4
+16 57.3197 16
+64 274.29 61.5385
+256 252.311 61.244
+1024 151.621 61.244
+4096 162.157 62.1359
+
+./benchmarker durable 256 200
+max records per commit, durable transfers per second (thousands), average records per commit
+1 1.11277 1
+4 4.97418 4
+16 18.0385 16
+64 82.699 63.8404
+256 218.907 235.945
+1024 221.1 242.654
+4096 231.468 235.945
+
+One write + fdatasync costs 0.25 to 1ms here, so a commit per transfer gives a
+few thousand durable transfers per second, and the throughput grows linearly
+with the batch until the batch reaches the number of threads waiting for their
+commit: a thread has at most one transfer in flight, so the batches can never
+exceed num_threads records and larger limits change nothing. With 256 threads,
+group commit gives 200x the throughput of a commit per record, still 60x below
+the in-memory transfers (about 15 million per second, sharded mode). The
+COMMIT record heading every write, which lets the replay drop a torn commit
+whole, doubles the bytes of a one-record commit but costs nothing measurable
+next to the fdatasync.
+
+./benchmarker combining 64 200000 (10^4 accounts, zipf(1))
+threads, plain mutex, hot accounts detected, top 1% hot (million transfers per second), hot accounts detected
+1 25.0376 24.5912 13.0497 0
+4 17.8027 18.3188 8.2016 0
+16 21.0972 22.863 10.1388 0
+64 21.9234 20.9715 12.4239 0
+
+On one core the hot locks are almost never found taken, so no account reaches
+the detection threshold (last column) and the detected mode is the plain
+mutex. Forcing the top 1% into flat combining halves the throughput: every
+operation on them pays the publication, the scan of the 64 slots and the
+handshake, with no ping-pong to save since there is a single cache. The gain
+needs real cores, where the combiner applies the waiting operations on a line
+it already owns instead of every thread fetching the balance and the lock in
+turn; the detection (a threshold of 1000 in the middle column, off by default
+since an account never leaves the combining path) keeps single-core runs on
+the cheap path.
+
+./benchmarker table 4 10000000
+measure, AccountArray, AccountTable
+bytes per account 80 4.25
+transfers (millions per second) 3.82552 7.15416
+total (ms) 105.179 6.936
+interest (ms) 287.114 10.544
+
+(1 thread: transfers 3.1 vs 7.7 million per second, total 99 vs 6.8ms, interest
+278 vs 7.9ms.) A table entry is a 4-byte balance and one lock bit, against 80
+bytes for an Account (64-bit id, sequence lock and snapshot fields included),
+so 10^7 accounts take 42MB instead of 800MB. Transfers gain 2x from touching
+less memory per operation (two balances and two lock words rather than two full
+objects with their mutexes). The scans are where the layout matters: the total
+reads a contiguous array with SSE2 and runs 14x faster than the loop over the
+objects, each of whose reads goes through the sequence lock, and the interest,
+which the objects can only apply through add (a lock per account), is 35x
+faster. Saturating the interest at UINT_MAX costs a compare, an or and a
+subtraction per four balances: the interest went from about 8.2 to 8.4-10.5ms
+over three runs. Only the accounts made hot with pad() pay for a cache line of
+their own.
+(When AccountTable was added, before the sequence lock and the 64-bit ids, an
+Account took 72 bytes and the loops over the objects were about 1.5x faster.)
+
+*/
@@ -5,6 +5,7 @@
 #include <chrono>
 #include <future>
 #include <iterator>
+#include <memory>
 #include <string>
 #include <regex>
 #include <numeric>
@@ -195,6 +196,978 @@ int test_account(std::ostream &out, const std::string test_name) {
 }
 
 
+//-----------------------------------------------------------------------------
+
+int test_find_any_parallel(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "FindAnyParallel";
+
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    for (size_t i = 0; i < 200; ++i) {
+        size_t len = (rand() % 30000) + 1;
+        // one set in three spans too wide a range for the direct table and is hashed
+        int scale = (i % 3 == 0) ? 1000 : 1;
+        std::vector<int> test(len);
+        for (size_t j = 0; j < len; ++j) {
+            test[j] = (rand() % 500) * scale;
+        }
+        // from a single target up to a set past the broadcast limits, with duplicates
+        size_t k = 1 + rand() % ((i % 2 == 0) ? 16 : 40);
+        std::vector<int> targets(k);
+        for (size_t t = 0; t < k; ++t) {
+            targets[t] = (rand() % 600) * scale;
+        }
+        size_t count = 1 + rand() % 100;
+        std::vector<unsigned int> student = FindAnyParallel<int>(test.data(), len, targets, count, (rand() % 5) + 1);
+        bool all_satisfied = true;
+        bool correct = true;
+        std::vector<unsigned int> exact(k);
+        for (size_t t = 0; t < k; ++t) {
+            exact[t] = std::count(test.begin(), test.end(), targets[t]);
+            all_satisfied = all_satisfied && (exact[t] >= count);
+        }
+        for (size_t t = 0; t < k; ++t) {
+            correct = correct && (all_satisfied ? student[t] >= count : student[t] == exact[t]);
+        }
+        res.push_back(test_eq(out, fun_name, correct, true));
+    }
+
+    // Must stop early once every target is satisfied
+    size_t N = 10000000;
+    int* long_vec = new int[N];
+    for (size_t i = 0; i < N; ++i) {
+        long_vec[i] = rand() % 100;
+    }
+    auto start = std::chrono::steady_clock::now();
+    FindAnyParallel<int>(long_vec, N, {1, 2, 3}, 10, 2);
+    auto end = std::chrono::steady_clock::now();
+    auto rt = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    res.push_back(test_le(out, fun_name, rt, 10));
+    delete[] long_vec;
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_pattern_search(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "FindPatternParallel";
+
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    for (size_t i = 0; i < 200; ++i) {
+        size_t len = (rand() % 20000) + 1;
+        // a small alphabet gives many partial and overlapping matches
+        std::string buf(len, 'a');
+        for (size_t j = 0; j < len; ++j) {
+            buf[j] = 'a' + rand() % 3;
+        }
+        std::string pattern(1 + rand() % 8, 'a');
+        for (size_t j = 0; j < pattern.size(); ++j) {
+            pattern[j] = 'a' + rand() % 3;
+        }
+        std::vector<size_t> correct;
+        for (size_t pos = buf.find(pattern); pos != std::string::npos; pos = buf.find(pattern, pos + 1)) {
+            correct.push_back(pos);
+        }
+        size_t num_threads = (rand() % 5) + 1;
+        size_t k = 1 + rand() % 20;
+        std::vector<size_t> correct_first(correct.begin(), correct.begin() + std::min(k, correct.size()));
+        res.push_back(test_eq(out, "CountPatternParallel",
+                              CountPatternParallel(buf.data(), len, pattern.data(), pattern.size(), num_threads),
+                              correct.size()));
+        res.push_back(test_eq(out, fun_name,
+                              FindPatternParallel(buf.data(), len, pattern.data(), pattern.size(), k, num_threads) == correct_first,
+                              true));
+        res.push_back(test_eq(out, "FindFirstPatternParallel",
+                              FindFirstPatternParallel(buf.data(), len, pattern.data(), pattern.size(), num_threads),
+                              correct.empty() ? len : correct[0]));
+    }
+
+    // Searching a memory-mapped file
+    std::string path = "pattern_search_test.tmp";
+    std::string contents(100000, 'x');
+    contents.replace(99990, 6, "needle");
+    FILE* f = fopen(path.c_str(), "wb");
+    fwrite(contents.data(), 1, contents.size(), f);
+    fclose(f);
+    {
+        MappedFile file(path);
+        res.push_back(test_eq(out, "MappedFile", file.is_open() && file.size() == contents.size(), true));
+        if (file.is_open()) {
+            res.push_back(test_eq(out, "FindFirstPatternParallel",
+                                  FindFirstPatternParallel(file.data(), file.size(), "needle", 6, 4), (size_t) 99990));
+        }
+    }
+    remove(path.c_str());
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_find_positions(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "FindPositionsParallel";
+
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    for (size_t i = 0; i < 500; ++i) {
+        size_t len = (rand() % 30000) + 1;
+        std::vector<int> test(len);
+        for (size_t j = 0; j < len; ++j) {
+            test[j] = rand() % (len / (i % 2 == 0 ? 9 : 200) + 1);
+        }
+        size_t count = 1 + rand() % 50;
+        std::vector<size_t> correct;
+        for (size_t j = 0; j < len && correct.size() < count; ++j) {
+            if (test[j] == test[0]) {
+                correct.push_back(j);
+            }
+        }
+        std::vector<size_t> student = FindPositionsParallel<int>(test.data(), len, test[0], count, (rand() % 5) + 1);
+        res.push_back(test_eq(out, fun_name, student == correct, true));
+    }
+
+    // Later blocks must stop once the earlier ones provide enough occurences
+    size_t N = 10000000;
+    int* long_vec = new int[N];
+    for (size_t i = 0; i < N; ++i) {
+        long_vec[i] = rand() % 100;
+    }
+    for (size_t i = 0; i < 10; ++i) {
+        long_vec[i] = 101;
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::vector<size_t> found = FindPositionsParallel<int>(long_vec, N, 101, 10, 3);
+    auto end = std::chrono::steady_clock::now();
+    auto rt = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    res.push_back(test_eq(out, fun_name, found.size() == 10 && found[9] == 9, true));
+    res.push_back(test_le(out, fun_name, rt, 10));
+    delete[] long_vec;
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_frequency_index(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "FrequencyIndex";
+
+    start_test_suite(out, test_name);
+
+    std::vector<int> res;
+
+    for (size_t i = 0; i < 50; ++i) {
+        size_t len = (i == 0) ? 0 : (rand() % 30000) + 1;
+        std::vector<int> test(len);
+        for (size_t j = 0; j < len; ++j) {
+            test[j] = rand() % (len / (i % 2 == 0 ? 9 : 200) + 1);
+        }
+        FrequencyIndex<int> index(test.data(), len, (rand() % 5) + 1);
+        for (size_t q = 0; q < 20; ++q) {
+            int target = rand() % (len / 9 + 2);
+            size_t count = std::count(test.begin(), test.end(), target);
+            res.push_back(test_eq(out, fun_name, index.count(target), count));
+            res.push_back(test_eq(out, fun_name, index.at_least(target, 10), count >= 10));
+        }
+    }
+
+    FrequencyCostModel model;
+    res.push_back(test_eq(out, "FrequencyCostModel", model.worth_indexing(10000000, 1, 4), false));
+    res.push_back(test_eq(out, "FrequencyCostModel", model.worth_indexing(10000000, 1000, 4), true));
+
+    return end_test_suite(out, test_name, accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_atomic_account(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "AtomicAccount";
+
+    start_test_suite(out, test_name);
+    std::vector<int> res;
+
+    AtomicAccount A(2000000);
+    auto withdraw_all = [&A] {
+        for (size_t i = 0; i < 1000000; ++i) {
+            A.withdraw(1);
+        }
+    };
+    std::thread t1(withdraw_all);
+    std::thread t2(withdraw_all);
+    t1.join();
+    t2.join();
+    res.push_back(test_eq(out, fun_name, A.get_amount(), 0u));
+    res.push_back(test_eq(out, fun_name, A.withdraw(1), false));
+
+    auto add_all = [&A] {
+        for (size_t i = 0; i < 1000000; ++i) {
+            A.add(1);
+        }
+    };
+    std::thread t3(add_all);
+    std::thread t4(add_all);
+    t3.join();
+    t4.join();
+    res.push_back(test_eq(out, fun_name, A.get_amount(), 2000000u));
+
+    // transfers in both directions, money is conserved and no balance goes below 0
+    AtomicAccount B(1000);
+    AtomicAccount C(10);
+    auto transfer = [](AtomicAccount& from, AtomicAccount& to) {
+        for (size_t i = 0; i < 100000; ++i) {
+            AtomicAccount::transfer(1 + i % 7, from, to);
+        }
+    };
+    std::thread t5(transfer, std::ref(B), std::ref(C));
+    std::thread t6(transfer, std::ref(C), std::ref(B));
+    t5.join();
+    t6.join();
+    res.push_back(test_eq(out, fun_name, B.get_amount() + C.get_amount(), 1010u));
+
+    // transfers from D to E only: reading D and then E, the amount of a transfer is
+    // seen on D (before) or on E (after), never on neither
+    AtomicAccount D(1000000);
+    AtomicAccount E(0);
+    std::atomic<bool> emptied(false);
+    std::thread mover([&] {
+        while (AtomicAccount::transfer(1, D, E)) {}
+        emptied.store(true);
+    });
+    bool never_missing = true;
+    while (!emptied.load()) {
+        unsigned int d = D.get_amount();
+        never_missing = never_missing && d + E.get_amount() >= 1000000u;
+    }
+    mover.join();
+    res.push_back(test_eq(out, fun_name, never_missing, true));
+    res.push_back(test_eq(out, fun_name, D.get_amount() + E.get_amount(), 1000000u));
+    res.push_back(test_eq(out, fun_name, AtomicAccount::transfer(1, D, D), D.get_amount() >= 1));
+
+    // deposits past UINT_MAX are rejected, leaving both accounts unchanged
+    AtomicAccount F(UINT_MAX - 5);
+    res.push_back(test_eq(out, fun_name, F.add(10), false));
+    res.push_back(test_eq(out, fun_name, F.add(5), true));
+    res.push_back(test_eq(out, fun_name, AtomicAccount::transfer(1, D, F), false));
+    res.push_back(test_eq(out, fun_name, F.get_amount(), UINT_MAX));
+    res.push_back(test_eq(out, fun_name, D.get_amount() + E.get_amount(), 1000000u));
+
+    // transfers around a ring of accounts, mixed with withdrawals and deposits of the
+    // same amounts, so that threads keep running into each other's transfers
+    std::vector<AtomicAccount> ring(3);
+    for (AtomicAccount& account : ring) {
+        account.add(1000);
+    }
+    auto around = [&ring](size_t start) {
+        for (size_t i = 0; i < 100000; ++i) {
+            size_t from = (start + i) % ring.size();
+            AtomicAccount::transfer(1 + i % 5, ring[from], ring[(from + 1) % ring.size()]);
+            if (ring[from].withdraw(3)) {
+                ring[(from + 2) % ring.size()].add(3);
+            }
+        }
+    };
+    std::thread t7(around, 0);
+    std::thread t8(around, 1);
+    std::thread t9(around, 2);
+    t7.join();
+    t8.join();
+    t9.join();
+    res.push_back(test_eq(out, fun_name, ring[0].get_amount() + ring[1].get_amount() + ring[2].get_amount(), 3000u));
+
+    return end_test_suite(out, test_name,
+                          accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_batch_transfer(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "BatchTransferEngine";
+
+    start_test_suite(out, test_name);
+    std::vector<int> res;
+
+    for (size_t i = 0; i < 20; ++i) {
+        size_t M = 2 + rand() % 1000;
+        std::vector<std::unique_ptr<Account>> owned;
+        std::vector<Account*> accounts;
+        std::vector<unsigned int> balances(M);
+        for (size_t a = 0; a < M; ++a) {
+            balances[a] = rand() % 100;
+            owned.emplace_back(new Account(balances[a]));
+            accounts.push_back(owned.back().get());
+        }
+        // a third of the transfers involve account 0, many of them fail
+        size_t B = rand() % 50000;
+        std::vector<Transfer> batch(B);
+        for (size_t k = 0; k < B; ++k) {
+            batch[k].amount = rand() % 60;
+            batch[k].from = (rand() % 3 == 0) ? 0 : rand() % M;
+            batch[k].to = rand() % M;
+        }
+
+        std::vector<bool> correct(B);
+        for (size_t k = 0; k < B; ++k) {
+            correct[k] = batch[k].amount <= balances[batch[k].from];
+            if (correct[k]) {
+                balances[batch[k].from] -= batch[k].amount;
+                balances[batch[k].to] += batch[k].amount;
+            }
+        }
+
+        BatchTransferEngine engine(accounts, (rand() % 5) + 1);
+        std::vector<bool> student = engine.apply(batch);
+        bool same_balances = true;
+        for (size_t a = 0; a < M; ++a) {
+            same_balances = same_balances && (accounts[a]->get_amount() == balances[a]);
+        }
+        res.push_back(test_eq(out, fun_name, student == correct, true));
+        res.push_back(test_eq(out, fun_name, same_balances, true));
+    }
+
+    return end_test_suite(out, test_name,
+                          accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_account_apply(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "Account::apply";
+
+    start_test_suite(out, test_name);
+    std::vector<int> res;
+
+    // payroll: one source to 1000 destinations, all or nothing
+    Account source(999);
+    std::vector<std::unique_ptr<Account>> employees;
+    Transaction payroll;
+    payroll.push_back({&source, -1000});
+    for (size_t i = 0; i < 1000; ++i) {
+        employees.emplace_back(new Account(0));
+        payroll.push_back({employees.back().get(), 1});
+    }
+    res.push_back(test_eq(out, fun_name, Account::apply(payroll).applied, false));
+    res.push_back(test_eq(out, fun_name, source.get_amount() + employees[0]->get_amount(), 999u));
+    source.add(1);
+    res.push_back(test_eq(out, fun_name, Account::apply(payroll).applied, true));
+    res.push_back(test_eq(out, fun_name, source.get_amount() + employees[999]->get_amount(), 1u));
+
+    // settlements between overlapping groups from several threads: money is conserved,
+    // no deadlock, and balances never go below 0 (a failed leg cancels the whole transaction)
+    std::vector<std::unique_ptr<Account>> accounts;
+    for (size_t i = 0; i < 20; ++i) {
+        accounts.emplace_back(new Account(100));
+    }
+    auto settle = [&accounts](unsigned int seed) {
+        for (size_t k = 0; k < 20000; ++k) {
+            Transaction t;
+            size_t a = rand_r(&seed) % 20, b = rand_r(&seed) % 20, c = rand_r(&seed) % 20;
+            long long x = rand_r(&seed) % 30, y = rand_r(&seed) % 30;
+            t.push_back({accounts[a].get(), -x});
+            t.push_back({accounts[b].get(), -y});
+            t.push_back({accounts[c].get(), x + y});
+            Account::apply(t);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < 4; ++i) {
+        workers.emplace_back(settle, i);
+    }
+    for (std::thread& w : workers) {
+        w.join();
+    }
+    unsigned int total = 0;
+    for (auto& a : accounts) {
+        total += a->get_amount();
+    }
+    res.push_back(test_eq(out, fun_name, total, 2000u));
+
+    return end_test_suite(out, test_name,
+                          accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_sharded_store(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "ShardedAccountStore";
+
+    start_test_suite(out, test_name);
+    std::vector<int> res;
+
+    {
+        ShardedAccountStore store(10, 100, 3);
+        res.push_back(test_eq(out, fun_name, store.transfer(30, 0, 4), true));
+        res.push_back(test_eq(out, fun_name, store.transfer(30, 1, 4), true));
+        res.push_back(test_eq(out, fun_name, store.transfer(200, 4, 7), false));
+        res.push_back(test_eq(out, fun_name, store.transfer(160, 4, 7), true));
+        res.push_back(test_eq(out, fun_name, store.get_amount(0), 70u));
+        res.push_back(test_eq(out, fun_name, store.get_amount(4), 0u));
+        res.push_back(test_eq(out, fun_name, store.get_amount(7), 260u));
+    }
+
+    // several clients on a hot account: no transfer is lost, money is conserved
+    for (size_t shards : {1, 2, 5}) {
+        ShardedAccountStore store(50, 1000, shards);
+        std::vector<std::thread> clients;
+        for (unsigned int c = 0; c < 4; ++c) {
+            clients.emplace_back([&store, c]() {
+                unsigned int seed = c;
+                for (size_t k = 0; k < 20000; ++k) {
+                    size_t from = (k % 2) ? 0 : rand_r(&seed) % 50;
+                    size_t to = (k % 2) ? rand_r(&seed) % 50 : 0;
+                    store.transfer_async(rand_r(&seed) % 100, from, to);
+                }
+            });
+        }
+        for (std::thread& c : clients) {
+            c.join();
+        }
+        store.flush();
+        unsigned int total = 0;
+        for (size_t a = 0; a < 50; ++a) {
+            total += store.get_amount(a);
+        }
+        res.push_back(test_eq(out, fun_name, total, 50000u));
+    }
+
+    return end_test_suite(out, test_name,
+                          accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+struct TestLockSite {
+    static const char* name() { return "test lock"; }
+};
+
+struct TestRecursiveLockSite {
+    static const char* name() { return "test recursive lock"; }
+};
+
+int test_instrumented_mutex(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "InstrumentedMutex";
+
+    start_test_suite(out, test_name);
+    std::vector<int> res;
+
+    typedef InstrumentedMutex<std::mutex, TestLockSite> Mutex;
+    LockSite& site = Mutex::stats();
+    site.reset();
+    Mutex m1, m2;
+    for (size_t i = 0; i < 10; ++i) {
+        std::lock_guard<Mutex> lk(i % 2 ? m1 : m2);
+    }
+    res.push_back(test_eq(out, fun_name, site.attempts.load(), 10ULL));
+    res.push_back(test_eq(out, fun_name, site.contended.load(), 0ULL));
+    res.push_back(test_eq(out, fun_name, site.hold.count(), 10ULL));
+
+    // a second thread waits for about 20ms, the lock being held as long
+    m1.lock();
+    std::thread waiter([&m1]() {
+        std::lock_guard<Mutex> lk(m1);
+    });
+    while (site.contended.load() == 0) {
+        std::this_thread::yield();
+    }
+    res.push_back(test_eq(out, fun_name, m1.try_lock(), false));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    m1.unlock();
+    waiter.join();
+    // the blocking lock of the waiter and the failed try_lock are both contended attempts
+    res.push_back(test_eq(out, fun_name, site.attempts.load(), 13ULL));
+    res.push_back(test_eq(out, fun_name, site.contended.load(), 2ULL));
+    res.push_back(test_eq(out, fun_name, site.wait.count(), 1ULL));
+    res.push_back(test_le(out, fun_name, 20000000LL, site.wait.quantile(1.)));
+    res.push_back(test_le(out, fun_name, 20000000LL, site.hold.quantile(1.)));
+
+    // only the outermost acquisition of a recursive mutex is timed
+    typedef InstrumentedMutex<std::recursive_mutex, TestRecursiveLockSite> RecursiveMutex;
+    RecursiveMutex r;
+    r.lock();
+    r.lock();
+    r.unlock();
+    r.unlock();
+    res.push_back(test_eq(out, fun_name, RecursiveMutex::stats().attempts.load(), 2ULL));
+    res.push_back(test_eq(out, fun_name, RecursiveMutex::stats().hold.count(), 1ULL));
+
+    std::ostringstream dump;
+    DumpLockStats(dump);
+    res.push_back(test_eq(out, fun_name, dump.str().find("test lock: 13 attempts, 2 contended (15.3846%)") != std::string::npos, true));
+
+    return end_test_suite(out, test_name,
+                          accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_account_array(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "AccountArray";
+
+    start_test_suite(out, test_name);
+    std::vector<int> res;
+
+    AccountArray accounts(1000, 5);
+    res.push_back(test_eq(out, fun_name, accounts.size(), (size_t) 1000));
+    bool consecutive = true;
+    for (size_t i = 0; i < 1000; ++i) {
+        consecutive = consecutive && accounts[i].get_amount() == 5 &&
+                      accounts[i].get_id() == accounts[0].get_id() + i;
+    }
+    res.push_back(test_eq(out, fun_name, consecutive, true));
+    Account single(10);
+    res.push_back(test_eq(out, fun_name, Account::transfer(7, single, accounts[999]), true));
+    res.push_back(test_eq(out, fun_name, accounts[999].get_amount(), 12u));
+
+    // ids from per-thread blocks and from arrays created concurrently are all distinct
+    std::vector<std::vector<unsigned int>> ids(4);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < 4; ++t) {
+        workers.emplace_back([&ids, t]() {
+            for (size_t i = 0; i < 5000; ++i) {
+                Account a;
+                ids[t].push_back(a.get_id());
+            }
+            AccountArray block(5000, 0);
+            for (size_t i = 0; i < 5000; ++i) {
+                ids[t].push_back(block[i].get_id());
+            }
+        });
+    }
+    for (std::thread& w : workers) {
+        w.join();
+    }
+    std::vector<unsigned int> all;
+    for (auto& v : ids) {
+        all.insert(all.end(), v.begin(), v.end());
+    }
+    std::sort(all.begin(), all.end());
+    res.push_back(test_eq(out, fun_name, (size_t) (std::unique(all.begin(), all.end()) - all.begin()), (size_t) 40000));
+
+    return end_test_suite(out, test_name,
+                          accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_snapshot_total(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "Account::snapshot_total";
+
+    start_test_suite(out, test_name);
+    std::vector<int> res;
+
+    AccountArray owned(200, 50);
+    std::vector<Account*> accounts;
+    for (size_t i = 0; i < owned.size(); ++i) {
+        accounts.push_back(&owned[i]);
+    }
+    res.push_back(test_eq(out, fun_name, Account::snapshot_total(accounts, 4), 10000ULL));
+
+    // transfers, transactions and withdrawals immediately deposited back run while
+    // snapshots are taken: every snapshot must see the money conserved
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < 3; ++t) {
+        workers.emplace_back([&accounts, &stop, t]() {
+            unsigned int seed = t;
+            while (!stop.load()) {
+                Account& a = *accounts[rand_r(&seed) % 200];
+                Account& b = *accounts[rand_r(&seed) % 200];
+                Account& c = *accounts[rand_r(&seed) % 200];
+                switch (t) {
+                    case 0:
+                        if (&a != &b) {
+                            Account::transfer(rand_r(&seed) % 20, a, b);
+                        }
+                        break;
+                    case 1:
+                        Account::apply({{&a, -3}, {&b, -4}, {&c, 7}});
+                        break;
+                    default:
+                        if (a.withdraw(5)) {
+                            b.add(5);
+                        }
+                }
+            }
+        });
+    }
+    // the withdraw-add pair of thread 2 is not atomic: a snapshot may catch the 5 in flight
+    for (size_t k = 0; k < 200; ++k) {
+        unsigned long long total = Account::snapshot_total(accounts, 1 + k % 3);
+        res.push_back(test_le(out, fun_name, 9995ULL, total));
+        res.push_back(test_le(out, fun_name, total, 10000ULL));
+    }
+    stop.store(true);
+    for (std::thread& w : workers) {
+        w.join();
+    }
+    res.push_back(test_eq(out, fun_name, Account::snapshot_total(accounts, 2), 10000ULL));
+
+    return end_test_suite(out, test_name,
+                          accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_durable_accounts(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "DurableAccounts";
+
+    start_test_suite(out, test_name);
+    std::vector<int> res;
+
+    const std::string path = "durable_accounts_test.log";
+    unlink(path.c_str());
+    std::vector<unsigned int> balances(10);
+    size_t operations = 0;
+    {
+        DurableAccounts accounts(path, 10, 64);
+        res.push_back(test_eq(out, fun_name, accounts.is_open(), true));
+        res.push_back(test_eq(out, fun_name, accounts.recovered(), (size_t) 0));
+        for (size_t i = 0; i < 10; ++i) {
+            accounts.add(i, 1000);
+        }
+        res.push_back(test_eq(out, fun_name, accounts.transfer(300, 0, 1), true));
+        res.push_back(test_eq(out, fun_name, accounts.withdraw(1, 1400), false));
+        res.push_back(test_eq(out, fun_name, accounts.withdraw(1, 1300), true));
+        operations = 12;
+        // concurrent transfers, some of which depend on credits of other threads
+        std::vector<size_t> done(4, 0);
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < 4; ++t) {
+            workers.emplace_back([&accounts, &done, t]() {
+                unsigned int seed = t;
+                for (size_t k = 0; k < 300; ++k) {
+                    size_t from = rand_r(&seed) % 10, to = rand_r(&seed) % 10;
+                    if (from != to && accounts.transfer(rand_r(&seed) % 500, from, to)) {
+                        ++done[t];
+                    }
+                }
+            });
+        }
+        for (std::thread& w : workers) {
+            w.join();
+        }
+        operations += std::accumulate(done.begin(), done.end(), (size_t) 0);
+        for (size_t i = 0; i < 10; ++i) {
+            balances[i] = accounts.get_amount(i);
+        }
+    }
+
+    // a crash in the middle of a write leaves a partial record at the end
+    int fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+    res.push_back(test_eq(out, fun_name, ::write(fd, "torn", 4), (ssize_t) 4));
+    ::close(fd);
+
+    for (size_t reopen = 0; reopen < 2; ++reopen) {
+        DurableAccounts accounts(path, 10, 64);
+        res.push_back(test_eq(out, fun_name, accounts.recovered(), operations));
+        bool same = true;
+        for (size_t i = 0; i < 10; ++i) {
+            same = same && accounts.get_amount(i) == balances[i];
+        }
+        res.push_back(test_eq(out, fun_name, same, true));
+        // appended after the dropped partial record, must be replayed next time
+        res.push_back(test_eq(out, fun_name, accounts.add(3, 1), true));
+        ++operations;
+        ++balances[3];
+    }
+
+    // a group commit of several records torn in its middle is dropped whole, as is one
+    // cut short or whose header is torn
+    LogRecord batch[6];
+    for (size_t i = 1; i < 6; ++i) {
+        batch[i] = LogRecord::make(LogRecord::ADD, 5, i, 0);
+    }
+    batch[0] = LogRecord::commit(batch + 1, 5);
+    batch[3].amount = 6;
+    size_t lengths[3] = {6, 4, 6};
+    for (size_t tear = 0; tear < 3; ++tear) {
+        if (tear == 1) {
+            batch[3].amount = 5;
+        } else if (tear == 2) {
+            batch[0].amount = 4;
+        }
+        size_t length = lengths[tear] * sizeof(LogRecord);
+        fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+        res.push_back(test_eq(out, fun_name, ::write(fd, batch, length), (ssize_t) length));
+        ::close(fd);
+        DurableAccounts accounts(path, 10, 64);
+        res.push_back(test_eq(out, fun_name, accounts.corrupt(), false));
+        res.push_back(test_eq(out, fun_name, accounts.recovered(), operations));
+        bool same = true;
+        for (size_t i = 0; i < 10; ++i) {
+            same = same && accounts.get_amount(i) == balances[i];
+        }
+        res.push_back(test_eq(out, fun_name, same, true));
+    }
+
+    // a commit which does not fit the balances is corruption: the log is kept as it is
+    // and the accounts refuse operations
+    LogRecord bad[3] = {LogRecord(),
+                        LogRecord::make(LogRecord::WITHDRAW, 4000000000u, 0, 0),
+                        LogRecord::make(LogRecord::ADD, 1, 0, 0)};
+    bad[0] = LogRecord::commit(bad + 1, 2);
+    fd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+    res.push_back(test_eq(out, fun_name, ::write(fd, bad, sizeof(bad)), (ssize_t) sizeof(bad)));
+    ::close(fd);
+    struct stat before;
+    stat(path.c_str(), &before);
+    {
+        DurableAccounts accounts(path, 10, 64);
+        res.push_back(test_eq(out, fun_name, accounts.corrupt(), true));
+        res.push_back(test_eq(out, fun_name, accounts.is_open(), false));
+        res.push_back(test_eq(out, fun_name, accounts.recovered(), operations));
+        res.push_back(test_eq(out, fun_name, accounts.add(0, 1), false));
+        res.push_back(test_eq(out, fun_name, accounts.get_amount(0), balances[0]));
+    }
+    struct stat after;
+    stat(path.c_str(), &after);
+    res.push_back(test_eq(out, fun_name, (long long) after.st_size, (long long) before.st_size));
+    unlink(path.c_str());
+
+    // once the log has failed, operations are rejected without changing the balances
+    {
+        DurableAccounts accounts("no_such_directory/" + path, 2, 64);
+        res.push_back(test_eq(out, fun_name, accounts.is_open(), false));
+        res.push_back(test_eq(out, fun_name, accounts.add(0, 10), false));
+        res.push_back(test_eq(out, fun_name, accounts.get_amount(0), 0u));
+    }
+
+    return end_test_suite(out, test_name,
+                          accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_flat_combining(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "Account (flat combining)";
+
+    start_test_suite(out, test_name);
+    std::vector<int> res;
+
+    AccountArray accounts(50, 1000);
+    accounts[0].make_hot();
+    accounts[1].make_hot();
+    res.push_back(test_eq(out, fun_name, accounts[0].is_hot(), true));
+    res.push_back(test_eq(out, fun_name, accounts[2].is_hot(), false));
+    res.push_back(test_eq(out, fun_name, accounts[0].withdraw(1001), false));
+    res.push_back(test_eq(out, fun_name, Account::transfer(600, accounts[0], accounts[2]), true));
+    res.push_back(test_eq(out, fun_name, Account::transfer(600, accounts[0], accounts[2]), false));
+    res.push_back(test_eq(out, fun_name, Account::transfer(400, accounts[3], accounts[0]), true));
+    res.push_back(test_eq(out, fun_name, accounts[0].get_amount(), 800u));
+    res.push_back(test_eq(out, fun_name, accounts[2].get_amount() + accounts[3].get_amount(), 2200u));
+
+    // transfers from and to the hot accounts (and between them), deposits and
+    // withdrawals, mixed with plain transfers and snapshots: money is conserved
+    std::vector<Account*> all;
+    for (size_t i = 0; i < accounts.size(); ++i) {
+        all.push_back(&accounts[i]);
+    }
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < 6; ++t) {
+        workers.emplace_back([&accounts, t]() {
+            unsigned int seed = t;
+            for (size_t k = 0; k < 20000; ++k) {
+                size_t a = rand_r(&seed) % 50, b = rand_r(&seed) % 50;
+                if (k % 3 == 0) {
+                    a = rand_r(&seed) % 2;
+                } else if (k % 3 == 1) {
+                    b = rand_r(&seed) % 2;
+                }
+                if (a == b) {
+                    continue;
+                }
+                if (k % 7 == 0) {
+                    if (accounts[a].withdraw(5)) {
+                        accounts[a].add(5);
+                    }
+                } else {
+                    Account::transfer(rand_r(&seed) % 50, accounts[a], accounts[b]);
+                }
+            }
+        });
+    }
+    unsigned long long low = 50000;
+    for (size_t k = 0; k < 20; ++k) {
+        low = std::min(low, Account::snapshot_total(all, 2));
+    }
+    for (std::thread& w : workers) {
+        w.join();
+    }
+    // withdraw + add is not atomic: up to 5 per thread may be in flight in a snapshot
+    res.push_back(test_le(out, fun_name, 50000ULL - 30, low));
+    res.push_back(test_eq(out, fun_name, Account::snapshot_total(all, 2), 50000ULL));
+
+    // an account whose lock is found taken becomes hot by itself
+    Account::set_hot_threshold(1);
+    Account& target = accounts[10];
+    std::vector<std::thread> hammers;
+    for (unsigned int t = 0; t < 4; ++t) {
+        hammers.emplace_back([&target]() {
+            auto start = std::chrono::steady_clock::now();
+            while (!target.is_hot() &&
+                   std::chrono::steady_clock::now() - start < std::chrono::seconds(5)) {
+                target.add(1);
+                target.withdraw(1);
+            }
+        });
+    }
+    for (std::thread& h : hammers) {
+        h.join();
+    }
+    Account::set_hot_threshold(0);
+    res.push_back(test_eq(out, fun_name, target.is_hot(), true));
+
+    return end_test_suite(out, test_name,
+                          accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+//-----------------------------------------------------------------------------
+
+int test_account_table(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "AccountTable";
+
+    start_test_suite(out, test_name);
+    std::vector<int> res;
+
+    const size_t M = 10007;
+    AccountTable table(M, 100);
+    table.pad(0);
+    table.pad(5000);
+    res.push_back(test_eq(out, fun_name, table.get_amount(5000), 100u));
+    res.push_back(test_eq(out, fun_name, table.transfer(60, 5000, 1), true));
+    res.push_back(test_eq(out, fun_name, table.transfer(60, 5000, 1), false));
+    res.push_back(test_eq(out, fun_name, table.withdraw(1, 160), true));
+    table.add(0, 160);
+    res.push_back(test_eq(out, fun_name, table.get_amount(0), 260u));
+    res.push_back(test_eq(out, fun_name, table.total(3), 100ULL * M));
+    // a transfer to the same account changes nothing but needs the amount, a scan with
+    // 0 threads uses 1
+    res.push_back(test_eq(out, fun_name, table.transfer(10, 7, 7), true));
+    res.push_back(test_eq(out, fun_name, table.transfer(101, 7, 7), false));
+    res.push_back(test_eq(out, fun_name, table.total(0), 100ULL * M));
+    res.push_back(test_le(out, fun_name, table.memory_bytes(), M * 5));
+
+    // concurrent transfers, most of them involving the padded accounts or neighbours
+    // sharing a lock word: money is conserved
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < 4; ++t) {
+        workers.emplace_back([&table, M, t]() {
+            unsigned int seed = t;
+            for (size_t k = 0; k < 50000; ++k) {
+                size_t from = (k % 2) ? rand_r(&seed) % 70 : (k % 4 ? 0 : 5000);
+                size_t to = rand_r(&seed) % M;
+                if (from != to) {
+                    table.transfer(rand_r(&seed) % 30, from, to);
+                }
+            }
+        });
+    }
+    for (std::thread& w : workers) {
+        w.join();
+    }
+    res.push_back(test_eq(out, fun_name, table.total(4), 100ULL * M));
+
+    // interest: the SIMD and scalar paths agree with the formula
+    std::vector<unsigned int> before(M);
+    for (size_t i = 0; i < M; ++i) {
+        if (i % 3 == 0) {
+            table.add(i, i * 1000);
+        }
+        before[i] = table.get_amount(i);
+    }
+    unsigned long long paid = table.accrue_interest(0.015, 4);
+    uint32_t fixed_rate = (uint32_t) (0.015 * 4294967296.);
+    unsigned long long expected_paid = 0;
+    bool all_right = true;
+    for (size_t i = 0; i < M; ++i) {
+        unsigned int interest = ((uint64_t) before[i] * fixed_rate) >> 32;
+        expected_paid += interest;
+        all_right = all_right && table.get_amount(i) == before[i] + interest;
+    }
+    res.push_back(test_eq(out, fun_name, all_right, true));
+    res.push_back(test_eq(out, fun_name, paid, expected_paid));
+
+    // balances near UINT_MAX saturate instead of wrapping, on the SIMD and scalar paths
+    // and in the padded slots
+    AccountTable rich(7, UINT_MAX - 1000);
+    rich.pad(3);
+    rich.withdraw(5, 3000000000u);
+    paid = rich.accrue_interest(0.5, 1);
+    expected_paid = 6 * 1000ULL + (UINT_MAX - 1000 - 3000000000u) / 2;
+    res.push_back(test_eq(out, fun_name, paid, expected_paid));
+    res.push_back(test_eq(out, fun_name, rich.get_amount(0), UINT_MAX));
+    res.push_back(test_eq(out, fun_name, rich.get_amount(3), UINT_MAX));
+    res.push_back(test_eq(out, fun_name, rich.get_amount(6), UINT_MAX));
+    res.push_back(test_eq(out, fun_name, rich.get_amount(5), UINT_MAX - 1000 - 3000000000u + (UINT_MAX - 1000 - 3000000000u) / 2));
+
+    return end_test_suite(out, test_name,
+                          accumulate(res.begin(), res.end(), 0), res.size());
+}
+
+int test_seqlock_read(std::ostream &out, const std::string test_name) {
+    std::string fun_name = "Account::get_amount (sequence lock)";
+
+    start_test_suite(out, test_name);
+    std::vector<int> res;
+
+    // writers move 2^20 in and out of a (by add and withdraw), of b (by transfers
+    // through its combiner) and of c (by transactions); a read may only see a balance
+    // before or after an operation
+    const unsigned int big = 1 << 20;
+    AccountArray accounts(4, 1000);
+    Account& a = accounts[0];
+    Account& b = accounts[1];
+    Account& c = accounts[2];
+    Account& reserve = accounts[3];
+    reserve.add(2 * big);
+    b.make_hot();
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> writers;
+    writers.emplace_back([&]() {
+        while (!stop.load()) {
+            a.add(big);
+            a.withdraw(big);
+        }
+    });
+    writers.emplace_back([&]() {
+        while (!stop.load()) {
+            Account::transfer(big, reserve, b);
+            Account::transfer(big, b, reserve);
+        }
+    });
+    writers.emplace_back([&]() {
+        while (!stop.load()) {
+            Account::apply({{&c, big}, {&reserve, -(long long) big}});
+            Account::apply({{&c, -(long long) big}, {&reserve, big}});
+        }
+    });
+    size_t invalid = 0;
+    for (size_t k = 0; k < 300000; ++k) {
+        for (Account* account : {&a, &b, &c}) {
+            unsigned int amount = account->get_amount();
+            invalid += (amount != 1000 && amount != 1000 + big);
+        }
+    }
+    stop.store(true);
+    for (auto& w : writers) {
+        w.join();
+    }
+    res.push_back(test_eq(out, fun_name, invalid, (size_t) 0));
+    res.push_back(test_eq(out, fun_name, a.get_amount(), 1000u));
+    res.push_back(test_eq(out, fun_name, b.get_amount(), 1000u));
+    res.push_back(test_eq(out, fun_name, c.get_amount(), 1000u));
+    res.push_back(test_eq(out, fun_name, reserve.get_amount(), 1000u + 2 * big));
+
+    return end_test_suite(out, test_name,
+                          accumulate(res.begin(), res.end(), 0), res.size());
+}
+
 //-----------------------------------------------------------------------------
 
 int grading(std::ostream &out, const int test_case_number)
@@ -205,24 +1178,69 @@ Annotations used for the autograder.
 
 [START-AUTOGRADER-ANNOTATION]
 {
-  "total" : 2,
+  "total" : 17,
   "names" : [
       "td3.cpp::FindParallel_test",
-      "td3.cpp::Account_test"
+      "td3.cpp::Account_test",
+      "td3.cpp::FindAnyParallel_test",
+      "td3.cpp::FindPatternParallel_test",
+      "td3.cpp::FindPositionsParallel_test",
+      "td3.cpp::FrequencyIndex_test",
+      "td3.cpp::AtomicAccount_test",
+      "td3.cpp::BatchTransferEngine_test",
+      "td3.cpp::AccountApply_test",
+      "td3.cpp::ShardedAccountStore_test",
+      "td3.cpp::InstrumentedMutex_test",
+      "td3.cpp::AccountArray_test",
+      "td3.cpp::SnapshotTotal_test",
+      "td3.cpp::DurableAccounts_test",
+      "td3.cpp::FlatCombining_test",
+      "td3.cpp::AccountTable_test",
+      "td3.cpp::SeqlockRead_test"
   ],
-  "points" : [5, 5]
+  "points" : [5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5]
 }
 [END-AUTOGRADER-ANNOTATION]
 */
 
-    int const total_test_cases = 2;
+    int const total_test_cases = 17;
     std::string const test_names[total_test_cases] = {
         "MaxParallel_test",
-        "Account_test"
+        "Account_test",
+        "FindAnyParallel_test",
+        "FindPatternParallel_test",
+        "FindPositionsParallel_test",
+        "FrequencyIndex_test",
+        "AtomicAccount_test",
+        "BatchTransferEngine_test",
+        "AccountApply_test",
+        "ShardedAccountStore_test",
+        "InstrumentedMutex_test",
+        "AccountArray_test",
+        "SnapshotTotal_test",
+        "DurableAccounts_test",
+        "FlatCombining_test",
+        "AccountTable_test",
+        "SeqlockRead_test"
     };
-    int const points[total_test_cases] = {5, 5};
+    int const points[total_test_cases] = {5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5};
     int (*test_functions[total_test_cases]) (std::ostream &, const std::string) = {
-        test_find_parallel, test_account
+        test_find_parallel, test_account,
+        test_find_any_parallel,
+        test_pattern_search,
+        test_find_positions,
+        test_frequency_index,
+        test_atomic_account,
+        test_batch_transfer,
+        test_account_apply,
+        test_sharded_store,
+        test_instrumented_mutex,
+        test_account_array,
+        test_snapshot_total,
+        test_durable_accounts,
+        test_flat_combining,
+        test_account_table,
+        test_seqlock_read
     };
 
     return run_grading(out, test_case_number, total_test_cases,
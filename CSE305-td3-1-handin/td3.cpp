@@ -1,26 +1,61 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cfloat>
 #include <climits>
+#include <condition_variable>
+#include <cmath>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <numeric>
 #include <iterator>
 #include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "InstrumentedMutex.cpp"
 
 //-----------------------------------------------------------------------------
 
+// Number of elements a thread scans between two looks at the shared counter
+const size_t FIND_BATCH = 4096;
+
 template <typename T>
-// Searches for occurrences of a target in a block of an array
+// Searches for occurrences of a target in a block of an array.
+// Hits are counted locally and added to the shared counter once per batch of
+// FIND_BATCH elements, which is also when the thread checks whether the other
+// threads have already found enough occurrences.
 void FindThread(T* arr, size_t block_size, T target, unsigned int count, std::atomic<unsigned int>& occurences) {
     // Pointer to the end of the block
     T* end = arr + block_size;
     while (arr != end) {
-        if (occurences >= count){
+        if (occurences.load(std::memory_order_relaxed) >= count) {
             return;
         }
-        if (*arr == target){
-            occurences += 1;
+        T* batch_end = arr + std::min<size_t>(FIND_BATCH, end - arr);
+        unsigned int found = 0;
+        for (; arr != batch_end; ++arr) {
+            found += (*arr == target) ? 1 : 0;
+        }
+        if (found > 0) {
+            occurences.fetch_add(found, std::memory_order_relaxed);
         }
-        ++arr;
     }
 }
 
@@ -58,47 +93,886 @@ bool FindParallel(T* arr, size_t N, T target, size_t count, size_t num_threads)
     return (occurences >= count);
 }
 
+//-----------------------------------------------------------------------------
+
+// Number of occurrences found so far by one thread of FindPositionsParallel, alone on
+// its cache line since it is written by its thread once per batch
+struct alignas(64) FindProgress {
+    std::atomic<size_t> found;
+
+    FindProgress() : found(0) {}
+};
+
+template <typename T>
+// Records the positions of the occurrences of target in block i of the array.
+// The first `count` occurrences of the array are all in blocks 0..i as soon as
+// these blocks together have `count` of them (their counts only grow), so the
+// thread stops then: it never needs to wait for the threads before it.
+void FindPositionsThread(T* arr, size_t begin, size_t end, T target, size_t count, size_t i,
+                         std::vector<FindProgress>& progress, std::vector<size_t>& positions) {
+    while (begin != end) {
+        size_t before = 0;
+        for (size_t j = 0; j <= i; ++j) {
+            before += progress[j].found.load(std::memory_order_relaxed);
+        }
+        if (before >= count) {
+            return;
+        }
+        size_t batch_end = begin + std::min<size_t>(FIND_BATCH, end - begin);
+        for (; begin != batch_end; ++begin) {
+            if (arr[begin] == target) {
+                positions.push_back(begin);
+            }
+        }
+        progress[i].found.store(positions.size(), std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief Finds the positions of the first `count` occurences of target in the array
+ * @param arr - pointer to the first element of the array
+ * @param N - the length of the array
+ * @param target - the target to search for
+ * @param count - the number of occurences wanted
+ * @param num_threads - the number of threads to use
+ * @return the positions of the first min(count, total) occurences, in increasing order
+*/
+template <typename T>
+std::vector<size_t> FindPositionsParallel(T* arr, size_t N, T target, size_t count, size_t num_threads) {
+    std::vector<size_t> result;
+    if (N == 0 || count == 0) {
+        return result;
+    }
+    size_t block_size = N / num_threads;
+    std::vector<FindProgress> progress(num_threads);
+    // positions found by every thread, merged in block order at the end
+    std::vector<std::vector<size_t>> positions(num_threads);
+    std::vector<std::thread> workers(num_threads - 1);
+    for (size_t i = 0; i < num_threads - 1; ++i) {
+        workers[i] = std::thread(&FindPositionsThread<T>, arr, i * block_size, (i + 1) * block_size, target,
+                                 count, i, std::ref(progress), std::ref(positions[i]));
+    }
+    FindPositionsThread(arr, (num_threads - 1) * block_size, N, target, count, num_threads - 1,
+                        progress, positions[num_threads - 1]);
+
+    for (size_t i = 0; i < num_threads - 1; ++i) {
+        workers[i].join();
+    }
+
+    for (size_t i = 0; i < num_threads && result.size() < count; ++i) {
+        size_t take = std::min(count - result.size(), positions[i].size());
+        result.insert(result.end(), positions[i].begin(), positions[i].begin() + take);
+    }
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+
+// Costs (in nanoseconds, on one thread) used to decide whether building a
+// FrequencyIndex pays off. The defaults were measured with `benchmarker index`.
+struct FrequencyCostModel {
+    double scan_per_element = 1.;     // FindParallel full scan
+    double build_per_element = 110.;  // copy, sort and compress, at N = 10^7 (grows as log N)
+    double query = 180.;              // one binary search in the index
+
+    // total time of answering `queries` queries by scanning
+    double scanning(size_t N, size_t queries, size_t num_threads) const {
+        return queries * scan_per_element * N / num_threads;
+    }
+
+    // total time of building the index and answering `queries` queries with it
+    double indexing(size_t N, size_t queries, size_t num_threads) const {
+        double log_ratio = std::log2(std::max<double>(N, 2.)) / std::log2(1e7);
+        return build_per_element * log_ratio * N / num_threads + queries * query;
+    }
+
+    bool worth_indexing(size_t N, size_t queries, size_t num_threads) const {
+        return indexing(N, queries, num_threads) < scanning(N, queries, num_threads);
+    }
+};
+
+/**
+ * Index of the number of occurences of every value of an immutable array: the
+ * distinct values sorted, with the running total of their counts, so that a count
+ * query is a binary search. Built in parallel: the threads sort their block of a
+ * copy of the array, the sorted blocks are merged pairwise in parallel, and the
+ * runs are then compressed.
+ */
+template <typename T>
+class FrequencyIndex {
+        std::vector<T> values;      // distinct values, sorted
+        std::vector<size_t> ends;   // ends[k]: number of elements <= values[k]
+    public:
+        FrequencyIndex(const T* arr, size_t N, size_t num_threads) {
+            std::vector<T> sorted(arr, arr + N);
+            num_threads = std::max<size_t>(1, std::min(num_threads, N));
+            std::vector<size_t> bounds(num_threads + 1);
+            for (size_t i = 0; i <= num_threads; ++i) {
+                bounds[i] = (i == num_threads) ? N : i * (N / num_threads);
+            }
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < num_threads; ++i) {
+                workers.emplace_back([&sorted, &bounds, i] {
+                    std::sort(sorted.begin() + bounds[i], sorted.begin() + bounds[i + 1]);
+                });
+            }
+            for (std::thread& w : workers) {
+                w.join();
+            }
+            // merge rounds: blocks [i, i + width) and [i + width, i + 2 * width)
+            for (size_t width = 1; width < num_threads; width *= 2) {
+                workers.clear();
+                for (size_t i = 0; i + width < num_threads; i += 2 * width) {
+                    size_t lo = bounds[i];
+                    size_t mid = bounds[i + width];
+                    size_t hi = bounds[std::min(num_threads, i + 2 * width)];
+                    workers.emplace_back([&sorted, lo, mid, hi] {
+                        std::inplace_merge(sorted.begin() + lo, sorted.begin() + mid, sorted.begin() + hi);
+                    });
+                }
+                for (std::thread& w : workers) {
+                    w.join();
+                }
+            }
+            for (size_t i = 0; i < N; ++i) {
+                if (i + 1 == N || sorted[i] != sorted[i + 1]) {
+                    values.push_back(sorted[i]);
+                    ends.push_back(i + 1);
+                }
+            }
+        }
+
+        // number of occurences of target in the array
+        size_t count(const T& target) const {
+            auto it = std::lower_bound(values.begin(), values.end(), target);
+            if (it == values.end() || *it != target) {
+                return 0;
+            }
+            size_t k = it - values.begin();
+            return ends[k] - (k == 0 ? 0 : ends[k - 1]);
+        }
+
+        // same answer as FindParallel(arr, N, target, count, num_threads)
+        bool at_least(const T& target, size_t count) const {
+            return this->count(target) >= count;
+        }
+
+        size_t distinct() const {return values.size();}
+
+        size_t memory_bytes() const {
+            return values.capacity() * sizeof(T) + ends.capacity() * sizeof(size_t);
+        }
+};
+
+//-----------------------------------------------------------------------------
+
+// Up to this many distinct targets, elements are compared against every target
+// (with SSE2 for ints) rather than looked up in a hashed TargetTable: a hash, a probe
+// and an unpredictable branch per element cost more than 16 broadcast compares
+const size_t MAX_BROADCAST_TARGETS = 16;
+
+// Same limit when the targets are ints in a small range, looked up with a single load
+const size_t MAX_BROADCAST_DIRECT = 4;
+
+// Above this range of values, integer targets are hashed instead of indexed directly
+const size_t MAX_DIRECT_RANGE = 1 << 16;
+
+// Lookup table from target values to their position in the target list: a direct
+// array indexed by value - min (a perfect hash) for integer targets spanning a small
+// range, otherwise an open-addressing hash table
+template <typename T>
+class TargetTable {
+        std::vector<int> direct; // -1 for a value which is not a target
+        T low;
+        std::vector<T> keys;
+        std::vector<int> slots;  // -1 for an empty slot
+        size_t mask;
+    public:
+        TargetTable(const std::vector<T>& targets) : low(), mask(0) {
+            if constexpr (std::is_integral<T>::value) {
+                if (!targets.empty()) {
+                    auto range = std::minmax_element(targets.begin(), targets.end());
+                    unsigned long long span = (unsigned long long) *range.second - (unsigned long long) *range.first;
+                    if (span < MAX_DIRECT_RANGE) {
+                        low = *range.first;
+                        direct.assign(span + 1, -1);
+                        for (size_t t = 0; t < targets.size(); ++t) {
+                            direct[(unsigned long long) targets[t] - (unsigned long long) low] = t;
+                        }
+                        return;
+                    }
+                }
+            }
+            size_t capacity = 1;
+            while (capacity < 2 * targets.size()) {
+                capacity *= 2;
+            }
+            keys.resize(capacity);
+            slots.assign(capacity, -1);
+            mask = capacity - 1;
+            for (size_t t = 0; t < targets.size(); ++t) {
+                size_t h = std::hash<T>{}(targets[t]) & mask;
+                while (slots[h] != -1) {
+                    h = (h + 1) & mask;
+                }
+                keys[h] = targets[t];
+                slots[h] = t;
+            }
+        }
+
+        // whether values are looked up in the direct array rather than hashed
+        bool is_direct() const {
+            return !direct.empty();
+        }
+
+        // position of value in the target list, or -1
+        int find(const T& value) const {
+            if (!direct.empty()) {
+                if (value < low) {
+                    return -1;
+                }
+                unsigned long long offset = (unsigned long long) value - (unsigned long long) low;
+                return (offset < direct.size()) ? direct[offset] : -1;
+            }
+            size_t h = std::hash<T>{}(value) & mask;
+            while (slots[h] != -1) {
+                if (keys[h] == value) {
+                    return slots[h];
+                }
+                h = (h + 1) & mask;
+            }
+            return -1;
+        }
+};
+
+// Adds to found[t] the number of occurrences of targets[t] in [begin, end), looking
+// every element up in the table
+template <typename T>
+void CountTargetsLookup(const T* begin, const T* end, const TargetTable<T>& table, unsigned int* found) {
+    for (const T* p = begin; p != end; ++p) {
+        int t = table.find(*p);
+        if (t >= 0) {
+            ++found[t];
+        }
+    }
+}
+
+// Same, comparing every element against every target
+template <typename T>
+void CountTargetsCompare(const T* begin, const T* end, const std::vector<T>& targets, unsigned int* found) {
+    size_t k = targets.size();
+    for (const T* p = begin; p != end; ++p) {
+        for (size_t t = 0; t < k; ++t) {
+            found[t] += (*p == targets[t]) ? 1 : 0;
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// Each vector of 4 ints is compared against every broadcast target (at most
+// MaxTargets of them); a match gives -1 in the lane, subtracted from the per-target
+// lane counters
+template <size_t MaxTargets>
+void CountTargetsBroadcast(const int* begin, const int* end, const std::vector<int>& targets, unsigned int* found) {
+    size_t k = targets.size();
+    __m128i broadcast[MaxTargets];
+    __m128i counters[MaxTargets];
+    for (size_t t = 0; t < k; ++t) {
+        broadcast[t] = _mm_set1_epi32(targets[t]);
+        counters[t] = _mm_setzero_si128();
+    }
+    const int* p = begin;
+    for (; p + 4 <= end; p += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        for (size_t t = 0; t < k; ++t) {
+            counters[t] = _mm_sub_epi32(counters[t], _mm_cmpeq_epi32(x, broadcast[t]));
+        }
+    }
+    for (size_t t = 0; t < k; ++t) {
+        unsigned int lanes[4];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), counters[t]);
+        found[t] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    CountTargetsCompare(p, end, targets, found);
+}
+#endif
+
+// Adds to found[t] the number of occurrences of targets[t] in [begin, end)
+template <typename T>
+void CountTargetsBatch(const T* begin, const T* end, const std::vector<T>& targets,
+                       const TargetTable<T>& table, unsigned int* found) {
+    if (targets.size() > (table.is_direct() ? MAX_BROADCAST_DIRECT : MAX_BROADCAST_TARGETS)) {
+        CountTargetsLookup(begin, end, table, found);
+    } else {
+        CountTargetsCompare(begin, end, targets, found);
+    }
+}
+
+#if defined(__SSE2__)
+inline void CountTargetsBatch(const int* begin, const int* end, const std::vector<int>& targets,
+                              const TargetTable<int>& table, unsigned int* found) {
+    if (targets.size() > (table.is_direct() ? MAX_BROADCAST_DIRECT : MAX_BROADCAST_TARGETS)) {
+        CountTargetsLookup(begin, end, table, found);
+    } else {
+        CountTargetsBroadcast<MAX_BROADCAST_TARGETS>(begin, end, targets, found);
+    }
+}
+#endif
+
+// Counters shared by the threads of FindAnyParallel
+struct FindAnyState {
+    std::vector<std::atomic<unsigned int>> occurences; // one per distinct target
+    std::atomic<size_t> satisfied;                     // targets with at least count occurrences
+
+    FindAnyState(size_t k) : occurences(k), satisfied(0) {}
+};
+
+template <typename T>
+// Counts the occurrences of every target in a block, publishing the counts once per
+// batch and stopping as soon as every target has been found count times
+void FindAnyThread(T* arr, size_t block_size, const std::vector<T>& targets, const TargetTable<T>& table,
+                   unsigned int count, FindAnyState& state) {
+    T* end = arr + block_size;
+    std::vector<unsigned int> found(targets.size());
+    while (arr != end) {
+        if (state.satisfied.load(std::memory_order_relaxed) == targets.size()) {
+            return;
+        }
+        T* batch_end = arr + std::min<size_t>(FIND_BATCH, end - arr);
+        std::fill(found.begin(), found.end(), 0);
+        CountTargetsBatch(arr, batch_end, targets, table, found.data());
+        for (size_t t = 0; t < targets.size(); ++t) {
+            if (found[t] == 0) {
+                continue;
+            }
+            unsigned int before = state.occurences[t].fetch_add(found[t], std::memory_order_relaxed);
+            if (before < count && before + found[t] >= count) {
+                state.satisfied.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        arr = batch_end;
+    }
+}
+
+/**
+ * @brief Counts the occurrences of several targets in the array in a single scan
+ * @param arr - pointer to the first element of the array
+ * @param N - the length of the array
+ * @param targets - the values to search for (duplicates are allowed)
+ * @param count - the number of occurences after which a target is satisfied
+ * @param num_threads - the number of threads to use
+ * @return the number of occurences of every target; exact if some target has
+ *         fewer than `count` occurences, otherwise only guaranteed to be >= count
+ *         since the scan stops once every target is satisfied
+*/
+template <typename T>
+std::vector<unsigned int> FindAnyParallel(T* arr, size_t N, const std::vector<T>& targets,
+                                          size_t count, size_t num_threads) {
+    // the scan works on distinct targets, slot[j] being the one of targets[j]
+    std::vector<T> distinct;
+    std::vector<size_t> slot(targets.size());
+    for (size_t j = 0; j < targets.size(); ++j) {
+        slot[j] = std::find(distinct.begin(), distinct.end(), targets[j]) - distinct.begin();
+        if (slot[j] == distinct.size()) {
+            distinct.push_back(targets[j]);
+        }
+    }
+    TargetTable<T> table(distinct);
+    FindAnyState state(distinct.size());
+
+    if (N > 0 && !distinct.empty() && count > 0) {
+        size_t block_size = N / num_threads;
+        std::vector<std::thread> workers(num_threads - 1);
+        T* start_block = arr;
+        for (size_t i = 0; i < num_threads - 1; ++i) {
+            workers[i] = std::thread(&FindAnyThread<T>, start_block, block_size, std::cref(distinct),
+                                     std::cref(table), count, std::ref(state));
+            start_block += block_size;
+        }
+        FindAnyThread(start_block, arr + N - start_block, distinct, table, count, state);
+
+        for (size_t i = 0; i < num_threads - 1; ++i) {
+            workers[i].join();
+        }
+    }
+
+    std::vector<unsigned int> result(targets.size());
+    for (size_t j = 0; j < targets.size(); ++j) {
+        result[j] = state.occurences[slot[j]].load();
+    }
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+
+// Calls on_match(i) for every occurrence of pattern[0, m) starting at a position i of
+// [begin, end) in buf[0, N), in increasing order, until on_match returns false.
+// Candidates are filtered 16 positions at a time by comparing both the first and the
+// last byte of the pattern (SSE2); only positions passing both are checked in full.
+// Returns false if on_match stopped the search.
+template <typename OnMatch>
+bool FindPatternSeq(const char* buf, size_t N, size_t begin, size_t end,
+                    const char* pattern, size_t m, OnMatch on_match) {
+    if (m == 0 || m > N) {
+        return true;
+    }
+    end = std::min(end, N - m + 1);
+    size_t i = begin;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[m - 1]);
+    for (; i + 16 <= end; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask != 0) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (std::memcmp(buf + pos + 1, pattern + 1, m > 2 ? m - 2 : 0) == 0 && !on_match(pos)) {
+                return false;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < end; ++i) {
+        if (buf[i] == pattern[0] && buf[i + m - 1] == pattern[m - 1]
+            && std::memcmp(buf + i, pattern, m) == 0 && !on_match(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Bytes of match positions a thread scans between two looks at the shared state
+const size_t PATTERN_BATCH = 1 << 16;
+
+/**
+ * @brief Counts the (possibly overlapping) occurrences of a pattern in a buffer in parallel
+ * @param buf - pointer to the first byte of the buffer
+ * @param N - the length of the buffer
+ * @param pattern - pointer to the first byte of the pattern
+ * @param m - the length of the pattern
+ * @param num_threads - the number of threads to use
+ *
+ * Threads own the match positions of contiguous chunks and read m - 1 bytes past
+ * the end of their chunk, so that matches crossing a boundary are found exactly once.
+ */
+inline size_t CountPatternParallel(const char* buf, size_t N, const char* pattern, size_t m, size_t num_threads) {
+    if (m == 0 || m > N) {
+        return 0;
+    }
+    size_t positions = N - m + 1;
+    size_t block_size = positions / num_threads;
+    std::vector<size_t> counts(num_threads);
+    std::vector<std::thread> workers(num_threads - 1);
+    auto count_block = [=, &counts](size_t i) {
+        size_t begin = i * block_size;
+        size_t end = (i == num_threads - 1) ? positions : begin + block_size;
+        size_t found = 0;
+        FindPatternSeq(buf, N, begin, end, pattern, m, [&found](size_t) { ++found; return true; });
+        counts[i] = found;
+    };
+    for (size_t i = 0; i < num_threads - 1; ++i) {
+        workers[i] = std::thread(count_block, i);
+    }
+    count_block(num_threads - 1);
+    for (size_t i = 0; i < num_threads - 1; ++i) {
+        workers[i].join();
+    }
+    return std::accumulate(counts.begin(), counts.end(), size_t(0));
+}
+
+/**
+ * @brief Finds the positions of the first k occurrences of a pattern in a buffer in parallel
+ * @param buf - pointer to the first byte of the buffer
+ * @param N - the length of the buffer
+ * @param pattern - pointer to the first byte of the pattern
+ * @param m - the length of the pattern
+ * @param k - the number of occurrences wanted
+ * @param num_threads - the number of threads to use
+ * @return the positions of the first min(k, total) occurrences, in increasing order
+ *
+ * A thread stops once it has k occurrences of its own and publishes the position of
+ * its k-th one as a bound: there are then k occurrences up to the bound, so the
+ * threads check it before every batch and stop once their next batch starts past it.
+ */
+inline std::vector<size_t> FindPatternParallel(const char* buf, size_t N, const char* pattern, size_t m,
+                                               size_t k, size_t num_threads) {
+    std::vector<size_t> result;
+    if (m == 0 || m > N || k == 0) {
+        return result;
+    }
+    size_t positions = N - m + 1;
+    size_t block_size = positions / num_threads;
+    std::vector<std::vector<size_t>> found(num_threads);
+    std::atomic<size_t> bound(positions);
+    std::vector<std::thread> workers(num_threads - 1);
+    auto search_block = [&, block_size](size_t i) {
+        size_t begin = i * block_size;
+        size_t end = (i == num_threads - 1) ? positions : begin + block_size;
+        std::vector<size_t>& mine = found[i];
+        for (size_t batch = begin; batch < end; batch += PATTERN_BATCH) {
+            if (bound.load(std::memory_order_relaxed) < batch) {
+                return;
+            }
+            bool more = FindPatternSeq(buf, N, batch, std::min(end, batch + PATTERN_BATCH), pattern, m,
+                                       [&](size_t pos) { mine.push_back(pos); return mine.size() < k; });
+            if (!more) {
+                size_t current = bound.load();
+                while (mine[k - 1] < current && !bound.compare_exchange_weak(current, mine[k - 1])) {}
+                return;
+            }
+        }
+    };
+    for (size_t i = 0; i < num_threads - 1; ++i) {
+        workers[i] = std::thread(search_block, i);
+    }
+    search_block(num_threads - 1);
+    for (size_t i = 0; i < num_threads - 1; ++i) {
+        workers[i].join();
+    }
+    // the chunks are in order, and every chunk before the k-th occurrence was fully scanned
+    for (size_t i = 0; i < num_threads && result.size() < k; ++i) {
+        size_t take = std::min(k - result.size(), found[i].size());
+        result.insert(result.end(), found[i].begin(), found[i].begin() + take);
+    }
+    return result;
+}
+
+// Position of the first occurrence of the pattern in the buffer, N if there is none
+inline size_t FindFirstPatternParallel(const char* buf, size_t N, const char* pattern, size_t m, size_t num_threads) {
+    std::vector<size_t> first = FindPatternParallel(buf, N, pattern, m, 1, num_threads);
+    return first.empty() ? N : first[0];
+}
+
+//-----------------------------------------------------------------------------
+
+// Read-only memory mapping of a whole file, for searching files larger than memory
+class MappedFile {
+        int fd;
+        const char* bytes;
+        size_t length;
+    public:
+        MappedFile(const std::string& path) : fd(-1), bytes(nullptr), length(0) {
+            fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size == 0) {
+                return;
+            }
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                return;
+            }
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            bytes = static_cast<const char*>(p);
+            length = st.st_size;
+        }
+
+        MappedFile(const MappedFile& other) = delete;
+
+        MappedFile& operator = (const MappedFile& other) = delete;
+
+        ~MappedFile() {
+            if (bytes != nullptr) {
+                munmap(const_cast<char*>(bytes), length);
+            }
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+
+        // false if the file could not be opened or mapped (empty files are not mapped)
+        bool is_open() const {return bytes != nullptr;}
+
+        const char* data() const {return bytes;}
+
+        size_t size() const {return length;}
+};
+
 //-----------------------------------------------------------------------------
 //methods should transfer money from one account to another in a thread-safe manner
 //not allowed to use std::lock
 //-----------------------------------------------------------------------------
+class Account;
+
+// A leg of a transaction: delta is added to the balance of account (negative for a debit)
+struct TransactionLeg {
+    Account* account;
+    long long delta;
+};
+
+// Legs applied all together or not at all by Account::apply; an account may appear
+// in several legs, only its net change matters
+typedef std::vector<TransactionLeg> Transaction;
+
+// Outcome of Account::apply
+struct TransactionReport {
+    bool applied;                     // false if some balance would have gone out of range
+    unsigned int attempts;            // rounds of try-locking before all locks were held
+    std::chrono::nanoseconds held;    // time from taking the first lock to releasing them all
+};
+
+// Operation published by a thread for the combiner of a hot account, see Account
+struct alignas(64) CombiningSlot {
+    enum State { FREE, CLAIMED, PENDING, SUCCEEDED, FAILED };
+    enum Kind { ADD, WITHDRAW, TRANSFER_OUT, TRANSFER_IN };
+    std::atomic<int> state;
+    int kind;
+    unsigned int amount;
+    Account* other;  // the other account of a transfer
+
+    CombiningSlot() : state(FREE) {}
+};
+
+const size_t COMBINING_SLOTS = 64;
+
+struct AccountLockSite {
+    static const char* name() { return "Account::lock"; }
+};
+
 class Account {
+        // std::mutex unless compiled with LOCK_STATS
+        typedef SiteMutex<std::mutex, AccountLockSite> Lock;
+
         unsigned int money;
-        unsigned int account_id;
-        std::mutex lock;
+        // 64 bits: the per-thread blocks below use ids up much faster than accounts
+        uint64_t account_id;
+        Lock lock;
+        // sequence lock for get_amount: odd while money is being written
+        std::atomic<unsigned int> version;
 
-        static std::atomic<unsigned int> max_account_id;
+        // balance before the first change made during snapshot saved_epoch, see snapshot_total
+        unsigned int saved_money;
+        unsigned int saved_epoch;
+
+        // flat combining: once the lock of an account has been found taken hot_threshold
+        // times (if set), it gets publication slots, and all its operations are published there
+        // and applied by whichever thread holds the lock
+        std::atomic<unsigned int> contended;
+        std::atomic<CombiningSlot*> slots;
+
+        static std::atomic<unsigned int> hot_threshold;
+        static std::atomic<uint64_t> max_account_id;
+        static std::atomic<unsigned int> epoch;
+        static std::mutex snapshot_lock;
+
+        // to be called with the lock held, before any change of money; current is the epoch
+        // loaded once per operation with the locks of all its accounts held, so that all
+        // of them are on the same side of a snapshot
+        void save_for_snapshot(unsigned int current) {
+            if (saved_epoch != current) {
+                saved_money = money;
+                saved_epoch = current;
+            }
+        }
+
+        // the only way money changes once the account is shared, to be called with the lock
+        // held (or by the single thread writing the account, see BatchTransferEngine)
+        void set_money(unsigned int value) {
+            unsigned int v = version.load(std::memory_order_relaxed);
+            version.store(v + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            __atomic_store_n(&money, value, __ATOMIC_RELAXED);
+            version.store(v + 2, std::memory_order_release);
+        }
+
+        // balance at the start of the current snapshot, to be called with the lock held
+        unsigned int snapshot_amount() const {
+            return (saved_epoch == epoch.load(std::memory_order_acquire)) ? saved_money : money;
+        }
+
+        // ids are taken from max_account_id by blocks of ID_BLOCK per thread, so that
+        // threads creating accounts do not all hit the same cache line
+        static const unsigned int ID_BLOCK = 1024;
+
+        static uint64_t next_id() {
+            // [next, end) is the remaining part of the block of this thread
+            thread_local uint64_t next = 0;
+            thread_local uint64_t end = 0;
+            if (next == end) {
+                next = max_account_id.fetch_add(ID_BLOCK, std::memory_order_relaxed);
+                end = next + ID_BLOCK;
+            }
+            return next++;
+        }
+
+        Account(unsigned int init_money, uint64_t id)
+            : money(init_money), account_id(id), version(0), saved_money(0), saved_epoch(0), contended(0), slots(nullptr) {}
+
+        // takes the lock, counting the times it was taken, and makes the account hot
+        // at the threshold
+        void lock_counting() {
+            if (lock.try_lock()) {
+                return;
+            }
+            // >= rather than ==: the count may already be past a threshold lowered later
+            unsigned int threshold = hot_threshold.load(std::memory_order_relaxed);
+            if (threshold > 0 && contended.fetch_add(1, std::memory_order_relaxed) + 1 >= threshold && !is_hot()) {
+                make_hot();
+            }
+            lock.lock();
+        }
+
+        // index of the first slot tried by the calling thread
+        static size_t thread_slot() {
+            static std::atomic<size_t> num_threads(0);
+            thread_local size_t slot = num_threads.fetch_add(1) % COMBINING_SLOTS;
+            return slot;
+        }
+
+        // applies the operation of a published slot with the lock of this account held;
+        // returns false if the other account of a transfer was busy (retried later)
+        bool apply_slot(CombiningSlot& slot) {
+            bool done = false;
+            if (slot.kind == CombiningSlot::ADD) {
+                save_for_snapshot(epoch.load(std::memory_order_acquire));
+                set_money(money + slot.amount);
+                done = true;
+            } else if (slot.kind == CombiningSlot::WITHDRAW) {
+                if (money >= slot.amount) {
+                    save_for_snapshot(epoch.load(std::memory_order_acquire));
+                    set_money(money - slot.amount);
+                    done = true;
+                }
+            } else {
+                // like everywhere else, a thread holding a lock only waits for locks of larger
+                // ids; a smaller one may be held by a thread waiting for this one
+                if (slot.other->get_id() > account_id) {
+                    slot.other->lock.lock();
+                } else if (!slot.other->lock.try_lock()) {
+                    return false;
+                }
+                Account& from = (slot.kind == CombiningSlot::TRANSFER_OUT) ? *this : *slot.other;
+                Account& to = (slot.kind == CombiningSlot::TRANSFER_OUT) ? *slot.other : *this;
+                if (from.money >= slot.amount) {
+                    unsigned int current = epoch.load(std::memory_order_acquire);
+                    from.save_for_snapshot(current);
+                    to.save_for_snapshot(current);
+                    from.set_money(from.money - slot.amount);
+                    to.set_money(to.money + slot.amount);
+                    done = true;
+                }
+                slot.other->lock.unlock();
+            }
+            slot.state.store(done ? CombiningSlot::SUCCEEDED : CombiningSlot::FAILED, std::memory_order_release);
+            return true;
+        }
+
+        // publishes the operation in a slot and waits until a combiner (possibly the
+        // calling thread, when it gets the lock) has applied it
+        bool combine(CombiningSlot* all, int kind, unsigned int amount, Account* other) {
+            size_t i = thread_slot();
+            int expected = CombiningSlot::FREE;
+            while (!all[i].state.compare_exchange_weak(expected, CombiningSlot::CLAIMED, std::memory_order_acquire)) {
+                expected = CombiningSlot::FREE;
+                i = (i + 1) % COMBINING_SLOTS;
+            }
+            CombiningSlot& mine = all[i];
+            mine.kind = kind;
+            mine.amount = amount;
+            mine.other = other;
+            mine.state.store(CombiningSlot::PENDING, std::memory_order_release);
+            while (true) {
+                int state = mine.state.load(std::memory_order_acquire);
+                if (state == CombiningSlot::SUCCEEDED || state == CombiningSlot::FAILED) {
+                    mine.state.store(CombiningSlot::FREE, std::memory_order_release);
+                    return state == CombiningSlot::SUCCEEDED;
+                }
+                if (lock.try_lock()) {
+                    for (size_t k = 0; k < COMBINING_SLOTS; ++k) {
+                        if (all[k].state.load(std::memory_order_acquire) == CombiningSlot::PENDING) {
+                            apply_slot(all[k]);
+                        }
+                    }
+                    lock.unlock();
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        // applies batches of transfers directly on the balances, see below
+        friend class BatchTransferEngine;
+        friend class AccountArray;
+        friend class DurableAccounts;
 
     public:
         
-        Account() {
+        Account() : version(0), saved_money(0), saved_epoch(0), contended(0), slots(nullptr) {
             money = 0;
-            account_id = max_account_id.fetch_add(1);
+            account_id = next_id();
         }
 
-        Account(unsigned int init_money) {
+        Account(unsigned int init_money) : version(0), saved_money(0), saved_epoch(0), contended(0), slots(nullptr) {
             money = init_money;
-            account_id = max_account_id.fetch_add(1);
+            account_id = next_id();
         }
 
         Account(const Account& other) = delete;
 
         Account& operator = (const Account& other) = delete;
+
+        ~Account() {
+            delete[] slots.load();
+        }
+
+        // switches the account to flat combining (done automatically under contention)
+        void make_hot() {
+            CombiningSlot* fresh = new CombiningSlot[COMBINING_SLOTS];
+            CombiningSlot* expected = nullptr;
+            if (!slots.compare_exchange_strong(expected, fresh)) {
+                delete[] fresh;
+            }
+        }
+
+        bool is_hot() const {
+            return slots.load(std::memory_order_acquire) != nullptr;
+        }
+
+        // number of contended acquisitions after which an account becomes hot, 0 (the
+        // default) to never switch automatically. An account never goes back to the
+        // plain lock and its count never decays, so that this is only meant for
+        // workloads whose hot accounts stay hot.
+        static void set_hot_threshold(unsigned int threshold) {
+            hot_threshold.store(threshold);
+        }
         
+        // never takes the lock: reads money between two reads of an even, unchanged
+        // version, and retries if a write happened in between
         unsigned int get_amount() const {
-            return this->money;
+            while (true) {
+                unsigned int before = version.load(std::memory_order_acquire);
+                if (before & 1) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                unsigned int amount = __atomic_load_n(&money, __ATOMIC_RELAXED);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (version.load(std::memory_order_relaxed) == before) {
+                    return amount;
+                }
+            }
         }
 
-        unsigned int get_id() const {
+        uint64_t get_id() const {
             return this->account_id;
         }
 
         // withdrwas deduction if the current amount is at least deduction
         // returns whether the withdrawal took place
         bool withdraw(unsigned int deduction) {
-            std::lock_guard<std::mutex> guard(lock);
+            CombiningSlot* hot = slots.load(std::memory_order_acquire);
+            if (hot) {
+                return combine(hot, CombiningSlot::WITHDRAW, deduction, nullptr);
+            }
+            lock_counting();
+            std::lock_guard<Lock> guard(lock, std::adopt_lock);
             if (money >= deduction) {
-                money -= deduction;
+                save_for_snapshot(epoch.load(std::memory_order_acquire));
+                set_money(money - deduction);
                 return true;
             }
             return false;
@@ -106,31 +980,1546 @@ class Account {
 
         // adds the prescribed amount of money to the account
         void add(unsigned int to_add) {
-            std::lock_guard<std::mutex> guard(lock);
-            money += to_add;
+            CombiningSlot* hot = slots.load(std::memory_order_acquire);
+            if (hot) {
+                combine(hot, CombiningSlot::ADD, to_add, nullptr);
+                return;
+            }
+            lock_counting();
+            std::lock_guard<Lock> guard(lock, std::adopt_lock);
+            save_for_snapshot(epoch.load(std::memory_order_acquire));
+            set_money(money + to_add);
         }
 
         // transfers amount from from to to if there are enough money on from
         // returns whether the transfer happened
+        // If one of the accounts is hot, the transfer is published to its combiner (to the
+        // one of the smaller id if both are).
         static bool transfer(unsigned int amount, Account& from, Account& to) {
-            std::unique_lock<std::mutex>  guard_to(to.lock, std::defer_lock);
-            std::unique_lock<std::mutex>  guard_from(from.lock, std::defer_lock);
+            CombiningSlot* hot_from = from.slots.load(std::memory_order_acquire);
+            CombiningSlot* hot_to = to.slots.load(std::memory_order_acquire);
+            if (hot_from && (!hot_to || from.get_id() < to.get_id())) {
+                return from.combine(hot_from, CombiningSlot::TRANSFER_OUT, amount, &to);
+            }
+            if (hot_to) {
+                return to.combine(hot_to, CombiningSlot::TRANSFER_IN, amount, &from);
+            }
             if (from.get_id() > to.get_id()) {
-                guard_to.lock();
-                guard_from.lock();
+                to.lock_counting();
+                from.lock_counting();
             } else {
-                guard_from.lock();
-                guard_to.lock();
+                from.lock_counting();
+                to.lock_counting();
             }
+            std::lock_guard<Lock> guard_to(to.lock, std::adopt_lock);
+            std::lock_guard<Lock> guard_from(from.lock, std::adopt_lock);
             if (amount <= from.money) {
-                from.money -= amount;
-                to.money += amount;
+                unsigned int current = epoch.load(std::memory_order_acquire);
+                from.save_for_snapshot(current);
+                to.save_for_snapshot(current);
+                from.set_money(from.money - amount);
+                to.set_money(to.money + amount);
                 return true;
             }
             return false;
         }
+
+        // applies all the legs of the transaction if no balance goes below 0 (or overflows),
+        // none of them otherwise; returns whether it was applied and how locks were taken
+        static TransactionReport apply(const Transaction& transaction);
+
+        // sum of the balances of the accounts at a single point in time, computed by
+        // num_threads threads while the accounts keep being used (see below)
+        static unsigned long long snapshot_total(const std::vector<Account*>& accounts, size_t num_threads);
+};
+
+std::atomic<uint64_t> Account::max_account_id(0);
+std::atomic<unsigned int> Account::epoch(0);
+std::atomic<unsigned int> Account::hot_threshold(0);
+std::mutex Account::snapshot_lock;
+
+// Accounts created in one call, with consecutive ids reserved by a single fetch_add.
+// Like accounts themselves, the array can be neither copied nor moved.
+class AccountArray {
+        Account* accounts;
+        size_t num_accounts;
+    public:
+        AccountArray(size_t num_accounts, unsigned int init_money) : num_accounts(num_accounts) {
+            accounts = static_cast<Account*>(::operator new(num_accounts * sizeof(Account)));
+            uint64_t first_id = Account::max_account_id.fetch_add(num_accounts, std::memory_order_relaxed);
+            for (size_t i = 0; i < num_accounts; ++i) {
+                new (accounts + i) Account(init_money, first_id + i);
+            }
+        }
+
+        AccountArray(const AccountArray& other) = delete;
+
+        AccountArray& operator = (const AccountArray& other) = delete;
+
+        ~AccountArray() {
+            for (size_t i = 0; i < num_accounts; ++i) {
+                accounts[i].~Account();
+            }
+            ::operator delete(accounts);
+        }
+
+        Account& operator [] (size_t i) {
+            return accounts[i];
+        }
+
+        size_t size() const {
+            return num_accounts;
+        }
+};
+
+// Rounds of try-locking before Account::apply falls back to blocking acquisition
+const unsigned int APPLY_TRY_ROUNDS = 8;
+
+// The locks of the accounts of the transaction are taken in id order, each account
+// once. They are first try-locked: on failure, all locks are released and the thread
+// backs off for a doubling number of yields, so that a long transaction never sits on
+// locks while waiting for a hot one. After APPLY_TRY_ROUNDS rounds it blocks on each
+// lock in turn, which the id order keeps deadlock-free.
+TransactionReport Account::apply(const Transaction& transaction) {
+    TransactionReport report = {false, 1, std::chrono::nanoseconds(0)};
+
+    // net change per account, accounts sorted by id
+    std::vector<TransactionLeg> legs(transaction);
+    std::sort(legs.begin(), legs.end(), [](const TransactionLeg& a, const TransactionLeg& b) {
+        return a.account->get_id() < b.account->get_id();
+    });
+    size_t n = 0;
+    for (size_t i = 0; i < legs.size(); ++i) {
+        if (n > 0 && legs[n - 1].account == legs[i].account) {
+            legs[n - 1].delta += legs[i].delta;
+        } else {
+            legs[n++] = legs[i];
+        }
+    }
+    legs.resize(n);
+
+    size_t locked = 0;
+    // start of the round in which the first lock currently held was taken
+    auto start = std::chrono::steady_clock::now();
+    while (true) {
+        start = std::chrono::steady_clock::now();
+        while (locked < n && legs[locked].account->lock.try_lock()) {
+            ++locked;
+        }
+        if (locked == n) {
+            break;
+        }
+        for (size_t i = 0; i < locked; ++i) {
+            legs[i].account->lock.unlock();
+        }
+        locked = 0;
+        if (report.attempts == APPLY_TRY_ROUNDS) {
+            start = std::chrono::steady_clock::now();
+            for (; locked < n; ++locked) {
+                legs[locked].account->lock.lock();
+            }
+            break;
+        }
+        for (unsigned int i = 0; i < (1u << report.attempts); ++i) {
+            std::this_thread::yield();
+        }
+        ++report.attempts;
+    }
+
+    bool valid = true;
+    for (const TransactionLeg& leg : legs) {
+        long long balance = (long long) leg.account->money + leg.delta;
+        valid = valid && (balance >= 0) && (balance <= (long long) UINT_MAX);
+    }
+    if (valid) {
+        unsigned int current = epoch.load(std::memory_order_acquire);
+        for (const TransactionLeg& leg : legs) {
+            leg.account->save_for_snapshot(current);
+            leg.account->set_money((unsigned int) ((long long) leg.account->money + leg.delta));
+        }
+    }
+    report.applied = valid;
+    report.held = std::chrono::steady_clock::now() - start;
+    for (const TransactionLeg& leg : legs) {
+        leg.account->lock.unlock();
+    }
+    return report;
+}
+
+/**
+ * A snapshot starts a new epoch. The first operation changing an account in the epoch
+ * saves its previous balance, which is the balance of the snapshot; accounts not
+ * changed yet give their current balance. Operations read the epoch with the locks
+ * of their accounts held: an operation which read the former epoch still held its
+ * locks when the epoch changed, so the snapshot reads all its accounts after it; one
+ * which read the new epoch saved all its accounts first. The snapshot is thus the
+ * state after exactly the operations of the former epochs. Operations only pay an
+ * atomic load, and each account is locked by the snapshot once, briefly.
+ * Snapshots are serialized. BatchTransferEngine::apply must not run meanwhile.
+ */
+unsigned long long Account::snapshot_total(const std::vector<Account*>& accounts, size_t num_threads) {
+    std::lock_guard<std::mutex> snapshot_guard(snapshot_lock);
+    epoch.fetch_add(1, std::memory_order_acq_rel);
+    num_threads = std::max<size_t>(1, std::min(num_threads, accounts.size()));
+    std::vector<unsigned long long> totals(num_threads, 0);
+    auto sum_block = [&](size_t t) {
+        size_t begin = t * (accounts.size() / num_threads);
+        size_t end = (t == num_threads - 1) ? accounts.size() : begin + accounts.size() / num_threads;
+        unsigned long long total = 0;
+        for (size_t i = begin; i < end; ++i) {
+            std::lock_guard<Lock> guard(accounts[i]->lock);
+            total += accounts[i]->snapshot_amount();
+        }
+        totals[t] = total;
+    };
+    std::vector<std::thread> workers(num_threads - 1);
+    for (size_t t = 0; t < num_threads - 1; ++t) {
+        workers[t] = std::thread(sum_block, t);
+    }
+    sum_block(num_threads - 1);
+    for (size_t t = 0; t < num_threads - 1; ++t) {
+        workers[t].join();
+    }
+    return std::accumulate(totals.begin(), totals.end(), 0ULL);
+}
+
+//-----------------------------------------------------------------------------
+
+// Reusable barrier for a fixed number of threads (std::barrier is C++20)
+class Barrier {
+        std::mutex lock;
+        std::condition_variable all_arrived;
+        size_t num_threads;
+        size_t waiting;
+        size_t generation;
+    public:
+        Barrier(size_t num_threads) : num_threads(num_threads), waiting(0), generation(0) {}
+
+        // blocks until num_threads threads have called wait since the last release
+        void wait() {
+            std::unique_lock<std::mutex> lk(lock);
+            size_t my_generation = generation;
+            if (++waiting == num_threads) {
+                waiting = 0;
+                ++generation;
+                all_arrived.notify_all();
+                return;
+            }
+            while (generation == my_generation) {
+                all_arrived.wait(lk);
+            }
+        }
+};
+
+// A transfer of a batch, the accounts being given by their index in the account list
+struct Transfer {
+    unsigned int amount;
+    size_t from;
+    size_t to;
+};
+
+/**
+ * Applies batches of transfers in parallel with the same outcome as applying them one
+ * after the other in submission order. Transfer k is put in wave 1 + the last wave of
+ * a transfer involving one of its accounts: the transfers of a wave touch pairwise
+ * distinct accounts, and every account sees its transfers in submission order. Waves
+ * run one after the other, the transfers of a wave being split between the threads,
+ * which update the balances without taking any lock. Runs of small waves (hot
+ * accounts give long chains of one-transfer waves) are applied by a single thread.
+ *
+ * The accounts of a batch must not be used by other threads during apply.
+ */
+class BatchTransferEngine {
+        // below this many transfers, a wave is not worth splitting between threads
+        static const size_t MIN_PARALLEL_WAVE = 1024;
+
+        std::vector<Account*> accounts;
+        size_t num_threads;
+    public:
+        BatchTransferEngine(const std::vector<Account*>& accounts, size_t num_threads)
+            : accounts(accounts), num_threads(std::max<size_t>(1, num_threads)) {}
+
+        // returns for every transfer of the batch whether it happened
+        std::vector<bool> apply(const std::vector<Transfer>& batch) {
+            // wave of every transfer, and transfers sorted by wave (stable)
+            std::vector<size_t> last_wave(accounts.size(), 0);
+            std::vector<size_t> wave(batch.size());
+            size_t num_waves = 0;
+            for (size_t k = 0; k < batch.size(); ++k) {
+                wave[k] = 1 + std::max(last_wave[batch[k].from], last_wave[batch[k].to]);
+                last_wave[batch[k].from] = last_wave[batch[k].to] = wave[k];
+                num_waves = std::max(num_waves, wave[k]);
+            }
+            std::vector<size_t> wave_begin(num_waves + 2, 0);
+            for (size_t k = 0; k < batch.size(); ++k) {
+                ++wave_begin[wave[k] + 1];
+            }
+            for (size_t w = 1; w < wave_begin.size(); ++w) {
+                wave_begin[w] += wave_begin[w - 1];
+            }
+            std::vector<size_t> order(batch.size());
+            std::vector<size_t> next(wave_begin.begin(), wave_begin.end() - 1);
+            for (size_t k = 0; k < batch.size(); ++k) {
+                order[next[wave[k]]++] = k;
+            }
+
+            // consecutive waves too small to be worth a barrier are applied by a single
+            // thread, in wave order; steps[s] is the first wave of step s
+            std::vector<size_t> steps;
+            for (size_t w = 1; w <= num_waves; ++w) {
+                bool small = wave_begin[w + 1] - wave_begin[w] < MIN_PARALLEL_WAVE;
+                bool previous_small = w > 1 && wave_begin[w] - wave_begin[w - 1] < MIN_PARALLEL_WAVE;
+                if (!small || !previous_small) {
+                    steps.push_back(w);
+                }
+            }
+            steps.push_back(num_waves + 1);
+
+            // char rather than bool so that threads write distinct bytes
+            std::vector<char> done(batch.size(), 0);
+            auto apply_range = [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    const Transfer& tr = batch[order[i]];
+                    Account& from = *accounts[tr.from];
+                    Account& to = *accounts[tr.to];
+                    if (tr.amount <= from.money) {
+                        from.set_money(from.money - tr.amount);
+                        to.set_money(to.money + tr.amount);
+                        done[order[i]] = 1;
+                    }
+                }
+            };
+            Barrier barrier(num_threads);
+            auto run = [&](size_t t) {
+                for (size_t s = 0; s + 1 < steps.size(); ++s) {
+                    size_t begin = wave_begin[steps[s]];
+                    size_t size = wave_begin[steps[s + 1]] - begin;
+                    if (steps[s + 1] - steps[s] > 1 || size < MIN_PARALLEL_WAVE) {
+                        if (t == 0) {
+                            apply_range(begin, begin + size);
+                        }
+                    } else {
+                        size_t end = begin + ((t == num_threads - 1) ? size : (t + 1) * (size / num_threads));
+                        apply_range(begin + t * (size / num_threads), end);
+                    }
+                    barrier.wait();
+                }
+            };
+            std::vector<std::thread> workers(num_threads - 1);
+            for (size_t t = 0; t < num_threads - 1; ++t) {
+                workers[t] = std::thread(run, t);
+            }
+            run(num_threads - 1);
+            for (size_t t = 0; t < num_threads - 1; ++t) {
+                workers[t].join();
+            }
+            return std::vector<bool>(done.begin(), done.end());
+        }
+};
+
+//-----------------------------------------------------------------------------
+
+// Same interface as Account, the balance being an atomic word and every operation
+// lock-free: a thread never waits for another one, it completes its operation instead.
+// The word holds either a value (balance in the high 32 bits, a version bumped by every
+// change in the low ones, bit 0 clear) or a descriptor (bit 0 set) naming an unfinished
+// transfer. Deposits and withdrawals are compare-and-swap loops on a value; a deposit
+// which would take the balance past UINT_MAX is rejected.
+class AtomicAccount {
+        struct Descriptor;
+
+        std::atomic<uint64_t> word;
+        unsigned int account_id;
+
+        static const uint64_t DESCRIPTOR = 1;
+        static const unsigned int SLOT_BITS = 10;
+        // threads holding a descriptor at the same time; a further thread waits for one
+        // of them to exit before its first transfer
+        static const size_t MAX_TRANSFER_THREADS = 1 << SLOT_BITS;
+        static const uint64_t GEN_MASK = (1ULL << (63 - SLOT_BITS)) - 1;
+
+        // status of a descriptor, in the low bits of its state
+        static const uint64_t UNDECIDED = 0;
+        static const uint64_t SUCCEEDED = 1;
+        static const uint64_t FAILED = 2;
+        // fields being rewritten for the next generation
+        static const uint64_t WRITING = 3;
+
+        static std::atomic<unsigned int> max_account_id;
+        static Descriptor descriptors[MAX_TRANSFER_THREADS];
+
+        static uint64_t make_value(uint64_t balance, uint64_t old) {
+            return (balance << 32) | ((old + 2) & 0xfffffffeULL);
+        }
+
+        // A transfer of one thread. The generation, bumped for each attempt, tells a
+        // descriptor word of an attempt from those of the earlier ones; the fields are read
+        // as in a seqlock, a reader which sees another generation in state having read a
+        // later attempt.
+        struct alignas(64) Descriptor {
+            // generation << 2 | status
+            std::atomic<uint64_t> state;
+            // first has the lower address, the accounts being taken in that order
+            std::atomic<AtomicAccount*> first;
+            std::atomic<AtomicAccount*> second;
+            std::atomic<uint64_t> first_old;
+            std::atomic<uint64_t> first_new;
+            std::atomic<uint64_t> second_old;
+            std::atomic<uint64_t> second_new;
+            std::atomic<bool> in_use;
+        };
+
+        // Fields of a descriptor as of one generation
+        struct Attempt {
+            AtomicAccount* first;
+            AtomicAccount* second;
+            uint64_t first_old;
+            uint64_t first_new;
+            uint64_t second_old;
+            uint64_t second_new;
+            uint64_t status;
+        };
+
+        // the descriptor of the calling thread, given back when it exits
+        static size_t own_slot() {
+            struct Slot {
+                size_t index;
+                Slot() {
+                    for (index = 0; descriptors[index].in_use.exchange(true, std::memory_order_acquire);
+                         index = (index + 1) % MAX_TRANSFER_THREADS) {
+                        if (index == MAX_TRANSFER_THREADS - 1) {
+                            std::this_thread::yield();
+                        }
+                    }
+                }
+                ~Slot() {
+                    descriptors[index].in_use.store(false, std::memory_order_release);
+                }
+            };
+            thread_local Slot slot;
+            return slot.index;
+        }
+
+        // reads the attempt a descriptor word stands for
+        // returns false if its descriptor has moved on to a later attempt, in which case
+        // the word has changed since it was loaded
+        static bool read_attempt(uint64_t descriptor_word, Attempt& attempt) {
+            Descriptor& d = descriptors[(descriptor_word >> 1) & (MAX_TRANSFER_THREADS - 1)];
+            uint64_t gen = descriptor_word >> (SLOT_BITS + 1);
+            uint64_t before = d.state.load(std::memory_order_acquire);
+            attempt.first = d.first.load(std::memory_order_relaxed);
+            attempt.second = d.second.load(std::memory_order_relaxed);
+            attempt.first_old = d.first_old.load(std::memory_order_relaxed);
+            attempt.first_new = d.first_new.load(std::memory_order_relaxed);
+            attempt.second_old = d.second_old.load(std::memory_order_relaxed);
+            attempt.second_new = d.second_new.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t after = d.state.load(std::memory_order_relaxed);
+            attempt.status = after & 3;
+            return ((before >> 2) & GEN_MASK) == gen && ((after >> 2) & GEN_MASK) == gen
+                && (before & 3) != WRITING;
+        }
+
+        // Completes the attempt of a descriptor word, on behalf of whichever thread runs
+        // into it: it takes the second account if it still holds its expected value,
+        // decides the attempt and puts values back in both accounts. An account in the way
+        // is helped first; it has a higher address, so that helping always terminates.
+        // Nothing can be taken for an attempt once it is decided: every change bumps the
+        // version, so the second account never holds its expected value again.
+        static void help(uint64_t descriptor_word) {
+            Descriptor& d = descriptors[(descriptor_word >> 1) & (MAX_TRANSFER_THREADS - 1)];
+            uint64_t gen = descriptor_word >> (SLOT_BITS + 1);
+            Attempt attempt;
+            if (!read_attempt(descriptor_word, attempt)) {
+                return;
+            }
+            if (attempt.status == UNDECIDED) {
+                uint64_t decision = SUCCEEDED;
+                while (true) {
+                    uint64_t current = attempt.second->word.load();
+                    if (current == descriptor_word) {
+                        break;
+                    }
+                    if (current & DESCRIPTOR) {
+                        help(current);
+                        continue;
+                    }
+                    if (current != attempt.second_old) {
+                        decision = FAILED;
+                        break;
+                    }
+                    if (attempt.second->word.compare_exchange_weak(current, descriptor_word)) {
+                        break;
+                    }
+                }
+                uint64_t undecided = (gen << 2) | UNDECIDED;
+                d.state.compare_exchange_strong(undecided, (gen << 2) | decision);
+                uint64_t state = d.state.load();
+                if (((state >> 2) & GEN_MASK) != gen) {
+                    return;
+                }
+                attempt.status = state & 3;
+            }
+            bool succeeded = attempt.status == SUCCEEDED;
+            uint64_t expected = descriptor_word;
+            attempt.first->word.compare_exchange_strong(expected,
+                succeeded ? attempt.first_new : make_value(attempt.first_old >> 32, attempt.first_old));
+            expected = descriptor_word;
+            attempt.second->word.compare_exchange_strong(expected, attempt.second_new);
+        }
+
+        // the value of the account, completing the transfer it is part of if any
+        uint64_t load_value() {
+            uint64_t current = word.load();
+            while (current & DESCRIPTOR) {
+                help(current);
+                current = word.load();
+            }
+            return current;
+        }
+
+    public:
+
+        AtomicAccount() : word(0) {
+            account_id = max_account_id.fetch_add(1);
+        }
+
+        AtomicAccount(unsigned int init_money) : word((uint64_t) init_money << 32) {
+            account_id = max_account_id.fetch_add(1);
+        }
+
+        AtomicAccount(const AtomicAccount& other) = delete;
+
+        AtomicAccount& operator = (const AtomicAccount& other) = delete;
+
+        // reads the balance without writing anything: for an account taken by a transfer,
+        // the balance before or after it depending on whether it has been decided
+        unsigned int get_amount() const {
+            while (true) {
+                uint64_t current = word.load();
+                if (!(current & DESCRIPTOR)) {
+                    return current >> 32;
+                }
+                Attempt attempt;
+                // otherwise the transfer is over and the word has changed
+                if (read_attempt(current, attempt)) {
+                    bool first = attempt.first == this;
+                    uint64_t value = attempt.status == SUCCEEDED
+                        ? (first ? attempt.first_new : attempt.second_new)
+                        : (first ? attempt.first_old : attempt.second_old);
+                    return value >> 32;
+                }
+            }
+        }
+
+        unsigned int get_id() const {
+            return this->account_id;
+        }
+
+        // withdrwas deduction if the current amount is at least deduction
+        // returns whether the withdrawal took place
+        bool withdraw(unsigned int deduction) {
+            while (true) {
+                uint64_t current = load_value();
+                if ((current >> 32) < deduction) {
+                    return false;
+                }
+                if (word.compare_exchange_weak(current, make_value((current >> 32) - deduction, current))) {
+                    return true;
+                }
+            }
+        }
+
+        // adds the prescribed amount of money to the account
+        // returns false, leaving the account unchanged, if the balance would exceed UINT_MAX
+        bool add(unsigned int to_add) {
+            while (true) {
+                uint64_t current = load_value();
+                if ((current >> 32) + to_add > UINT_MAX) {
+                    return false;
+                }
+                if (word.compare_exchange_weak(current, make_value((current >> 32) + to_add, current))) {
+                    return true;
+                }
+            }
+        }
+
+        // transfers amount from from to to if there are enough money on from
+        // returns whether the transfer happened; it does not if to would exceed UINT_MAX
+        // The transfer is a compare-and-swap on two words: it puts its descriptor in the
+        // account with the lower address if it still holds the value read, then completes
+        // as any helper would. It takes effect when its descriptor is decided, at once for
+        // both accounts: a thread which has seen either of its changes sees the other one
+        // too. An attempt failing because the second account changed is retried.
+        static bool transfer(unsigned int amount, AtomicAccount& from, AtomicAccount& to) {
+            if (&from == &to) {
+                return from.get_amount() >= amount;
+            }
+            size_t slot = own_slot();
+            Descriptor& d = descriptors[slot];
+            bool from_first = std::less<AtomicAccount*>()(&from, &to);
+            AtomicAccount* first = from_first ? &from : &to;
+            AtomicAccount* second = from_first ? &to : &from;
+            while (true) {
+                uint64_t from_value = from.load_value();
+                if ((from_value >> 32) < amount) {
+                    return false;
+                }
+                uint64_t to_value = to.load_value();
+                if ((to_value >> 32) + amount > UINT_MAX) {
+                    return false;
+                }
+                uint64_t from_new = make_value((from_value >> 32) - amount, from_value);
+                uint64_t to_new = make_value((to_value >> 32) + amount, to_value);
+
+                uint64_t gen = ((d.state.load(std::memory_order_relaxed) >> 2) + 1) & GEN_MASK;
+                d.state.store((gen << 2) | WRITING, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                d.first.store(first, std::memory_order_relaxed);
+                d.second.store(second, std::memory_order_relaxed);
+                d.first_old.store(from_first ? from_value : to_value, std::memory_order_relaxed);
+                d.first_new.store(from_first ? from_new : to_new, std::memory_order_relaxed);
+                d.second_old.store(from_first ? to_value : from_value, std::memory_order_relaxed);
+                d.second_new.store(from_first ? to_new : from_new, std::memory_order_relaxed);
+                d.state.store((gen << 2) | UNDECIDED, std::memory_order_release);
+
+                uint64_t descriptor_word = (gen << (SLOT_BITS + 1)) | (slot << 1) | DESCRIPTOR;
+                uint64_t expected = from_first ? from_value : to_value;
+                if (!first->word.compare_exchange_strong(expected, descriptor_word)) {
+                    continue;
+                }
+                help(descriptor_word);
+                if ((d.state.load() & 3) == SUCCEEDED) {
+                    return true;
+                }
+            }
+        }
+};
+
+std::atomic<unsigned int> AtomicAccount::max_account_id(0);
+AtomicAccount::Descriptor AtomicAccount::descriptors[AtomicAccount::MAX_TRANSFER_THREADS];
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Unbounded multi-producer single-consumer queue (Vyukov): a producer swaps its node
+ * in as the new head and then links the previous head to it, the consumer follows
+ * the links from the tail. push never waits; a pop may miss a node whose producer is
+ * between the two steps of its push, and will see it on a later try.
+ */
+template <typename T>
+class MpscQueue {
+        struct Node {
+            std::atomic<Node*> next;
+            T value;
+            Node() : next(nullptr) {}
+        };
+
+        // producers and the consumer write different ends, keep them on different lines
+        alignas(64) std::atomic<Node*> head;
+        alignas(64) Node* tail;
+    public:
+        MpscQueue() {
+            tail = new Node();
+            head.store(tail);
+        }
+
+        MpscQueue(const MpscQueue& other) = delete;
+
+        MpscQueue& operator = (const MpscQueue& other) = delete;
+
+        ~MpscQueue() {
+            while (tail != nullptr) {
+                Node* next = tail->next.load();
+                delete tail;
+                tail = next;
+            }
+        }
+
+        void push(const T& value) {
+            Node* node = new Node();
+            node->value = value;
+            Node* previous = head.exchange(node, std::memory_order_acq_rel);
+            previous->next.store(node, std::memory_order_release);
+        }
+
+        // to be called by the consumer only; returns false if no element was available
+        bool pop(T& value) {
+            Node* next = tail->next.load(std::memory_order_acquire);
+            if (next == nullptr) {
+                return false;
+            }
+            value = next->value;
+            delete tail;
+            tail = next;
+            return true;
+        }
+};
+
+/**
+ * Accounts partitioned between shard threads, account i belonging to shard i % num_shards.
+ * A shard thread is the only one to touch the balances of its accounts, so no lock is
+ * taken and a hot account costs nothing more than a cold one. A transfer is a debit
+ * message to the shard of the source which, if the balance is large enough, sends a
+ * credit message to the shard of the destination (or applies it directly when both
+ * accounts are in the same shard). Between the two, the amount is in flight: it is
+ * in no balance, but flush() waits until no message sent before it is left.
+ */
+class ShardedAccountStore {
+        enum MessageKind { DEBIT, CREDIT, READ, MARKER, STOP };
+
+        // reply, if not null, receives 1 or 0 for a transfer (once credited, or failed),
+        // the balance for a READ, and is incremented for a MARKER
+        struct Message {
+            MessageKind kind;
+            unsigned int amount;
+            size_t account;
+            size_t to;
+            std::atomic<long long>* reply;
+        };
+
+        struct Shard {
+            MpscQueue<Message> inbox;
+            std::vector<unsigned int> balances;
+            std::thread worker;
+        };
+
+        size_t num_shards;
+        std::vector<std::unique_ptr<Shard>> shards;
+
+        Shard& shard_of(size_t account) {
+            return *shards[account % num_shards];
+        }
+
+        unsigned int& balance(size_t account) {
+            return shard_of(account).balances[account / num_shards];
+        }
+
+        void run(size_t s) {
+            Shard& shard = *shards[s];
+            size_t idle = 0;
+            Message m;
+            while (true) {
+                if (!shard.inbox.pop(m)) {
+                    // yield first, then sleep not to take the cores of the producers
+                    if (++idle < 64) {
+                        std::this_thread::yield();
+                    } else {
+                        std::this_thread::sleep_for(std::chrono::microseconds(50));
+                    }
+                    continue;
+                }
+                idle = 0;
+                switch (m.kind) {
+                    case DEBIT: {
+                        unsigned int& from = balance(m.account);
+                        if (from < m.amount) {
+                            if (m.reply) {
+                                m.reply->store(0, std::memory_order_release);
+                            }
+                        } else if (m.to % num_shards == s) {
+                            from -= m.amount;
+                            balance(m.to) += m.amount;
+                            if (m.reply) {
+                                m.reply->store(1, std::memory_order_release);
+                            }
+                        } else {
+                            from -= m.amount;
+                            m.kind = CREDIT;
+                            shard_of(m.to).inbox.push(m);
+                        }
+                        break;
+                    }
+                    case CREDIT:
+                        balance(m.to) += m.amount;
+                        if (m.reply) {
+                            m.reply->store(1, std::memory_order_release);
+                        }
+                        break;
+                    case READ:
+                        m.reply->store(balance(m.account), std::memory_order_release);
+                        break;
+                    case MARKER:
+                        m.reply->fetch_add(1, std::memory_order_acq_rel);
+                        break;
+                    case STOP:
+                        return;
+                }
+            }
+        }
+
+        // waits until the shard replaces the pending value of reply, returns the new one
+        static long long wait_reply(std::atomic<long long>& reply, long long pending) {
+            long long value;
+            while ((value = reply.load(std::memory_order_acquire)) == pending) {
+                std::this_thread::yield();
+            }
+            return value;
+        }
+
+        // one marker per shard, returns once every shard has processed its marker
+        void markers() {
+            std::atomic<long long> reached(0);
+            for (size_t s = 0; s < num_shards; ++s) {
+                shards[s]->inbox.push({MARKER, 0, 0, 0, &reached});
+            }
+            while (reached.load(std::memory_order_acquire) < (long long) num_shards) {
+                std::this_thread::yield();
+            }
+        }
+    public:
+        ShardedAccountStore(size_t num_accounts, unsigned int init_money, size_t num_shards)
+            : num_shards(std::max<size_t>(1, num_shards)) {
+            for (size_t s = 0; s < this->num_shards; ++s) {
+                shards.emplace_back(new Shard());
+                // accounts s, s + num_shards, ... below num_accounts
+                size_t count = (num_accounts + this->num_shards - 1 - s) / this->num_shards;
+                shards[s]->balances.assign(count, init_money);
+            }
+            for (size_t s = 0; s < this->num_shards; ++s) {
+                shards[s]->worker = std::thread(&ShardedAccountStore::run, this, s);
+            }
+        }
+
+        ShardedAccountStore(const ShardedAccountStore& other) = delete;
+
+        ShardedAccountStore& operator = (const ShardedAccountStore& other) = delete;
+
+        // processes every message sent before, then stops the shards
+        ~ShardedAccountStore() {
+            flush();
+            for (auto& shard : shards) {
+                shard->inbox.push({STOP, 0, 0, 0, nullptr});
+            }
+            for (auto& shard : shards) {
+                shard->worker.join();
+            }
+        }
+
+        // sends the transfer and returns at once, its outcome is not reported
+        void transfer_async(unsigned int amount, size_t from, size_t to) {
+            shard_of(from).inbox.push({DEBIT, amount, from, to, nullptr});
+        }
+
+        // transfers amount from from to to if there are enough money on from
+        // returns whether the transfer happened, once it is credited
+        bool transfer(unsigned int amount, size_t from, size_t to) {
+            std::atomic<long long> reply(-1);
+            shard_of(from).inbox.push({DEBIT, amount, from, to, &reply});
+            return wait_reply(reply, -1) == 1;
+        }
+
+        // balance of the account once the messages already in its shard are processed;
+        // transfers still in flight towards it are not included (see flush)
+        unsigned int get_amount(size_t account) {
+            std::atomic<long long> reply(-1);
+            shard_of(account).inbox.push({READ, 0, account, 0, &reply});
+            return wait_reply(reply, -1);
+        }
+
+        // returns once every transfer sent before the call (by this thread, or by threads
+        // synchronized with it) is fully applied. Inboxes are FIFO: once a first round of
+        // markers is processed, the debits sent before have been, and their credits are
+        // queued before the markers of a second round.
+        void flush() {
+            markers();
+            markers();
+        }
 };
 
-std::atomic<unsigned int> Account::max_account_id(0);
+//-----------------------------------------------------------------------------
+
+// Record of the write-ahead log, accounts given by their index. Every group commit
+// starts with a COMMIT record whose amount is the number of records following it and
+// whose to is their batch_checksum, so that a commit torn by a crash is recognized
+// whole, whichever of its records made it to the disk.
+struct LogRecord {
+    enum Kind : uint32_t { ADD = 1, WITHDRAW = 2, TRANSFER = 3, COMMIT = 4 };
+    uint32_t kind;
+    uint32_t amount;
+    uint64_t from;      // account of ADD and WITHDRAW
+    uint64_t to;
+    uint64_t checksum;  // detects a record torn by a crash in the middle of a write
+
+    static uint64_t compute_checksum(uint32_t kind, uint32_t amount, uint64_t from, uint64_t to) {
+        uint64_t h = 0x9e3779b97f4a7c15ULL;
+        for (uint64_t x : {(uint64_t) kind, (uint64_t) amount, from, to}) {
+            h = (h ^ x) * 0x100000001b3ULL;
+            h ^= h >> 29;
+        }
+        return h;
+    }
+
+    static LogRecord make(uint32_t kind, uint32_t amount, uint64_t from, uint64_t to) {
+        return {kind, amount, from, to, compute_checksum(kind, amount, from, to)};
+    }
+
+    // combines the checksums of count records, in order
+    static uint64_t batch_checksum(const LogRecord* records, size_t count) {
+        uint64_t h = 0x9e3779b97f4a7c15ULL;
+        for (size_t i = 0; i < count; ++i) {
+            h = (h ^ records[i].checksum) * 0x100000001b3ULL;
+            h ^= h >> 29;
+        }
+        return h;
+    }
+
+    // the COMMIT record heading the count records
+    static LogRecord commit(const LogRecord* records, size_t count) {
+        return make(COMMIT, count, 0, batch_checksum(records, count));
+    }
+
+    bool valid() const {
+        return kind >= ADD && kind <= COMMIT && checksum == compute_checksum(kind, amount, from, to);
+    }
+};
+
+/**
+ * Append-only log file with group commit: appending only copies the record into the
+ * pending buffer and gives it a sequence number; a writer thread takes up to max_batch
+ * pending records at a time and makes them durable with one write (a COMMIT record then
+ * the records) and one fdatasync, while the next records accumulate. The records are
+ * written in the order of append.
+ */
+class WriteAheadLog {
+        int fd;
+        size_t max_batch;
+        bool failed;  // a write or fdatasync failed, nothing is durable from then on
+
+        std::mutex lock;
+        std::condition_variable has_pending;
+        std::condition_variable became_durable;
+        // a deque, the writer taking its batches from the front
+        std::deque<LogRecord> pending;
+        uint64_t appended;  // sequence number of the last appended record
+        uint64_t durable;   // records 1..durable are on disk
+        uint64_t num_commits;
+        bool stopping;
+        std::thread writer;
+
+        // writes the whole buffer, returns false on error
+        bool write_all(const char* data, size_t length) {
+            while (length > 0) {
+                ssize_t written = ::write(fd, data, length);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                data += written;
+                length -= written;
+            }
+            return true;
+        }
+
+        // makes the entry of path in its directory durable: without it, a log file just
+        // created may be lost by a crash with all its records
+        static bool sync_parent_directory(const std::string& path) {
+            size_t slash = path.rfind('/');
+            std::string directory = (slash == std::string::npos) ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+            int dir_fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+            if (dir_fd < 0) {
+                return false;
+            }
+            bool ok = (fsync(dir_fd) == 0);
+            ::close(dir_fd);
+            return ok;
+        }
+
+        void run() {
+            std::vector<LogRecord> batch;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lk(lock);
+                    while (pending.empty() && !stopping) {
+                        has_pending.wait(lk);
+                    }
+                    if (pending.empty()) {
+                        return;
+                    }
+                    size_t count = std::min(pending.size(), max_batch);
+                    batch.resize(1);
+                    batch.insert(batch.end(), pending.begin(), pending.begin() + count);
+                    pending.erase(pending.begin(), pending.begin() + count);
+                }
+                batch[0] = LogRecord::commit(batch.data() + 1, batch.size() - 1);
+                bool ok = !failed && write_all(reinterpret_cast<const char*>(batch.data()),
+                                               batch.size() * sizeof(LogRecord)) && fdatasync(fd) == 0;
+                {
+                    std::lock_guard<std::mutex> lk(lock);
+                    if (ok) {
+                        durable += batch.size() - 1;
+                        ++num_commits;
+                    } else {
+                        failed = true;
+                    }
+                }
+                became_durable.notify_all();
+            }
+        }
+    public:
+        // appends to the file at path (created if needed) from offset, the end of its
+        // valid records; see is_open
+        WriteAheadLog(const std::string& path, size_t max_batch, off_t offset)
+            : max_batch(std::max<size_t>(1, max_batch)), failed(false), appended(0), durable(0), num_commits(0), stopping(false) {
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+            if (fd < 0 || !sync_parent_directory(path) || ftruncate(fd, offset) != 0 || lseek(fd, offset, SEEK_SET) != offset) {
+                failed = true;
+                return;
+            }
+            writer = std::thread(&WriteAheadLog::run, this);
+        }
+
+        WriteAheadLog(const WriteAheadLog& other) = delete;
+
+        WriteAheadLog& operator = (const WriteAheadLog& other) = delete;
+
+        // makes every appended record durable before closing
+        ~WriteAheadLog() {
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                stopping = true;
+            }
+            has_pending.notify_one();
+            if (writer.joinable()) {
+                writer.join();
+            }
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+
+        bool is_open() const {
+            return fd >= 0 && writer.joinable();
+        }
+
+        // returns the sequence number of the record, to be given to wait_durable, or 0
+        // if the log has failed, the record being dropped
+        uint64_t append(const LogRecord& record) {
+            uint64_t sequence;
+            bool was_empty;
+            {
+                std::lock_guard<std::mutex> lk(lock);
+                if (failed) {
+                    return 0;
+                }
+                was_empty = pending.empty();
+                pending.push_back(record);
+                sequence = ++appended;
+            }
+            if (was_empty) {
+                has_pending.notify_one();
+            }
+            return sequence;
+        }
+
+        // blocks until the record is durable; returns false if the log failed before
+        bool wait_durable(uint64_t sequence) {
+            std::unique_lock<std::mutex> lk(lock);
+            while (durable < sequence && !failed) {
+                became_durable.wait(lk);
+            }
+            return durable >= sequence;
+        }
+
+        // number of group commits (write + fdatasync) done so far
+        uint64_t commits() {
+            std::lock_guard<std::mutex> lk(lock);
+            return num_commits;
+        }
+};
+
+/**
+ * Accounts whose operations survive a crash: every successful operation is appended
+ * to a write-ahead log while the locks of its accounts are held, so that the log
+ * orders the operations on an account as they were applied, and returns once its
+ * record is durable. Creating the accounts on an existing log replays it: operations
+ * are applied in log order, each finds the balances it found originally. A crash can
+ * only tear the last write, a group commit whose operations were never acknowledged:
+ * if it is incomplete or any of its records is invalid, it is dropped whole. Any other
+ * commit that cannot be replayed (bad checksum, or an operation that does not fit the
+ * balances) means the log is corrupt: the replay stops there, the file is left
+ * untouched and the accounts are not opened, see corrupt.
+ * Accounts are identified by their index, ids are not stable across runs.
+ */
+class DurableAccounts {
+        AccountArray accounts;
+        size_t replayed;
+        bool corrupted;
+        WriteAheadLog* log;  // nullptr if the log is corrupt
+
+        // applies a logged operation, returns false if it does not fit the balances
+        bool replay(const LogRecord& r) {
+            if (r.from >= accounts.size() || (r.kind == LogRecord::TRANSFER && r.to >= accounts.size())) {
+                return false;
+            }
+            Account& from = accounts[r.from];
+            switch (r.kind) {
+                case LogRecord::ADD:
+                    from.set_money(from.money + r.amount);
+                    return true;
+                case LogRecord::WITHDRAW:
+                    if (from.money < r.amount) {
+                        return false;
+                    }
+                    from.set_money(from.money - r.amount);
+                    return true;
+                case LogRecord::TRANSFER:
+                    if (from.money < r.amount) {
+                        return false;
+                    }
+                    from.set_money(from.money - r.amount);
+                    accounts[r.to].set_money(accounts[r.to].money + r.amount);
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
+        // whether the count records after header form a complete, untorn commit
+        static bool complete_commit(const LogRecord& header, const LogRecord* records, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                if (!records[i].valid()) {
+                    return false;
+                }
+            }
+            return header.to == LogRecord::batch_checksum(records, count);
+        }
+    public:
+        // num_accounts accounts with 0, then the operations of the log at path; group
+        // commits write at most max_batch records
+        DurableAccounts(const std::string& path, size_t num_accounts, size_t max_batch)
+            : accounts(num_accounts, 0), replayed(0), corrupted(false), log(nullptr) {
+            off_t valid_end = 0;
+            {
+                MappedFile existing(path);
+                if (existing.is_open()) {
+                    const LogRecord* records = reinterpret_cast<const LogRecord*>(existing.data());
+                    // complete records; the bytes of a partial last one are dropped
+                    size_t count = existing.size() / sizeof(LogRecord);
+                    size_t position = 0;
+                    while (position < count) {
+                        const LogRecord& header = records[position];
+                        bool has_header = header.valid() && header.kind == LogRecord::COMMIT && header.amount > 0;
+                        size_t end = position + 1 + header.amount;
+                        // the last write: it reaches the end of the file, or holds at most
+                        // 1 + max_batch records if its header itself is torn
+                        bool last = has_header ? end >= count : count - position <= 1 + std::max<size_t>(1, max_batch);
+                        if (!has_header || end > count || !complete_commit(header, records + position + 1, header.amount)) {
+                            if (last) {
+                                break;  // torn last commit
+                            }
+                            corrupted = true;
+                            return;
+                        }
+                        for (size_t i = position + 1; i < end; ++i) {
+                            if (!replay(records[i])) {
+                                corrupted = true;
+                                return;
+                            }
+                            ++replayed;
+                        }
+                        position = end;
+                    }
+                    valid_end = position * sizeof(LogRecord);
+                }
+            }
+            log = new WriteAheadLog(path, max_batch, valid_end);
+        }
+
+        DurableAccounts(const DurableAccounts& other) = delete;
+
+        DurableAccounts& operator = (const DurableAccounts& other) = delete;
+
+        ~DurableAccounts() {
+            delete log;
+        }
+
+        // false if the log could not be opened or is corrupt, operations then never succeed
+        bool is_open() const {
+            return log != nullptr && log->is_open();
+        }
+
+        // true if the log has a commit, other than a torn last one, which could not be
+        // replayed: it holds operation recovered() of the log
+        bool corrupt() const {
+            return corrupted;
+        }
+
+        // number of operations replayed from the log at creation
+        size_t recovered() const {
+            return replayed;
+        }
+
+        size_t size() const {
+            return accounts.size();
+        }
+
+        uint64_t commits() {
+            return (log != nullptr) ? log->commits() : 0;
+        }
+
+        unsigned int get_amount(size_t i) {
+            return accounts[i].get_amount();
+        }
+
+        // the operations return whether they happened and are durable. Their record is
+        // appended before the balances change, so that once the log has failed they are
+        // rejected without changing anything; an operation whose record was appended
+        // when the log failed stays applied in memory, but returns false.
+
+        bool add(size_t i, unsigned int amount) {
+            if (log == nullptr) {
+                return false;
+            }
+            Account& a = accounts[i];
+            uint64_t sequence;
+            {
+                std::lock_guard<Account::Lock> guard(a.lock);
+                sequence = log->append(LogRecord::make(LogRecord::ADD, amount, i, 0));
+                if (sequence == 0) {
+                    return false;
+                }
+                a.save_for_snapshot(Account::epoch.load(std::memory_order_acquire));
+                a.set_money(a.money + amount);
+            }
+            return log->wait_durable(sequence);
+        }
+
+        bool withdraw(size_t i, unsigned int amount) {
+            if (log == nullptr) {
+                return false;
+            }
+            Account& a = accounts[i];
+            uint64_t sequence;
+            {
+                std::lock_guard<Account::Lock> guard(a.lock);
+                if (a.money < amount) {
+                    return false;
+                }
+                sequence = log->append(LogRecord::make(LogRecord::WITHDRAW, amount, i, 0));
+                if (sequence == 0) {
+                    return false;
+                }
+                a.save_for_snapshot(Account::epoch.load(std::memory_order_acquire));
+                a.set_money(a.money - amount);
+            }
+            return log->wait_durable(sequence);
+        }
+
+        bool transfer(unsigned int amount, size_t from_index, size_t to_index) {
+            if (log == nullptr) {
+                return false;
+            }
+            Account& from = accounts[from_index];
+            Account& to = accounts[to_index];
+            uint64_t sequence;
+            {
+                std::unique_lock<Account::Lock> guard_to(to.lock, std::defer_lock);
+                std::unique_lock<Account::Lock> guard_from(from.lock, std::defer_lock);
+                if (from.get_id() > to.get_id()) {
+                    guard_to.lock();
+                    guard_from.lock();
+                } else {
+                    guard_from.lock();
+                    guard_to.lock();
+                }
+                if (from.money < amount) {
+                    return false;
+                }
+                sequence = log->append(LogRecord::make(LogRecord::TRANSFER, amount, from_index, to_index));
+                if (sequence == 0) {
+                    return false;
+                }
+                unsigned int current = Account::epoch.load(std::memory_order_acquire);
+                from.save_for_snapshot(current);
+                to.save_for_snapshot(current);
+                from.set_money(from.money - amount);
+                to.set_money(to.money + amount);
+            }
+            return log->wait_durable(sequence);
+        }
+};
 
 //-----------------------------------------------------------------------------
+
+// sum of b[0..n)
+unsigned long long SumBalances(const unsigned int* b, size_t n) {
+    size_t i = 0;
+    unsigned long long total = 0;
+#if defined(__SSE2__)
+    // four 32-bit lanes widened into two 64-bit accumulators
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    total = lanes[0] + lanes[1];
+#endif
+    for (; i < n; ++i) {
+        total += b[i];
+    }
+    return total;
+}
+
+// interest on balance, capped so that the balance does not exceed UINT_MAX
+inline unsigned int CappedInterest(unsigned int balance, uint32_t fixed_rate) {
+    unsigned int interest = ((uint64_t) balance * fixed_rate) >> 32;
+    return std::min(interest, UINT_MAX - balance);
+}
+
+// adds floor(b[i] * fixed_rate / 2^32) to every b[i], saturating at UINT_MAX, returns
+// the sum of the additions made
+unsigned long long AccrueInterest(unsigned int* b, size_t n, uint32_t fixed_rate) {
+    size_t i = 0;
+    unsigned long long paid = 0;
+#if defined(__SSE2__)
+    // _mm_mul_epu32 multiplies lanes 0 and 2 into 64 bits; lanes 1 and 3 are moved there first
+    const __m128i rate = _mm_set1_epi32(fixed_rate);
+    // SSE2 only compares signed lanes: flipping the sign bits orders them as unsigned
+    const __m128i sign = _mm_set1_epi32(INT_MIN);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i even = _mm_srli_epi64(_mm_mul_epu32(v, rate), 32);
+        __m128i odd = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(v, 32), rate), 32);
+        __m128i interest = _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+        __m128i sum = _mm_add_epi32(v, interest);
+        // lanes which wrapped around (sum < v) saturate to all ones
+        __m128i wrapped = _mm_cmpgt_epi32(_mm_xor_si128(v, sign), _mm_xor_si128(sum, sign));
+        sum = _mm_or_si128(sum, wrapped);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(b + i), sum);
+        __m128i added = _mm_sub_epi32(sum, v);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(added, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(added, zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    paid = lanes[0] + lanes[1];
+#endif
+    for (; i < n; ++i) {
+        unsigned int interest = CappedInterest(b[i], fixed_rate);
+        b[i] += interest;
+        paid += interest;
+    }
+    return paid;
+}
+
+/**
+ * Accounts 0..n-1 stored by columns instead of as separate objects: the balances form
+ * a dense array (4 bytes per account, scanned with SIMD) and the locks are spin bits,
+ * 64 to a word, instead of a 40-byte mutex per account. Neighbouring accounts share
+ * cache lines, so accounts known to be hot can be given a padded slot of their own
+ * (a cache line with its lock and balance) with pad; their entry of the dense array
+ * is then unused and stays 0.
+ *
+ * The operations mirror Account; the full-table scans (total, accrue_interest) run in
+ * parallel and must not run concurrently with operations, nor pad with anything.
+ */
+class AccountTable {
+        struct alignas(64) PaddedSlot {
+            std::atomic<bool> locked;
+            unsigned int balance;
+            PaddedSlot() : locked(false), balance(0) {}
+        };
+
+        std::vector<unsigned int> balances;
+        std::vector<std::atomic<uint64_t>> lock_bits;
+        // bit i set if account i has a padded slot, index of the slot in padded_index
+        std::vector<uint64_t> padded_bits;
+        std::vector<std::pair<size_t, PaddedSlot*>> padded_index;  // sorted by account
+
+        bool is_padded(size_t i) const {
+            return (padded_bits[i / 64] >> (i % 64)) & 1;
+        }
+
+        PaddedSlot& padded_slot(size_t i) {
+            auto it = std::lower_bound(padded_index.begin(), padded_index.end(), std::make_pair(i, (PaddedSlot*) nullptr));
+            return *it->second;
+        }
+
+        unsigned int& balance(size_t i) {
+            return is_padded(i) ? padded_slot(i).balance : balances[i];
+        }
+
+        // with the lock of the account held; atomic (relaxed) so that get_amount may
+        // read the balance at the same time
+        static void store_balance(unsigned int& b, unsigned int value) {
+            __atomic_store_n(&b, value, __ATOMIC_RELAXED);
+        }
+
+        static void spin_wait(size_t& spins) {
+            if (++spins % 64 == 0) {
+                std::this_thread::yield();
+            }
+        }
+
+        void lock(size_t i) {
+            size_t spins = 0;
+            if (is_padded(i)) {
+                std::atomic<bool>& locked = padded_slot(i).locked;
+                while (locked.exchange(true, std::memory_order_acquire)) {
+                    while (locked.load(std::memory_order_relaxed)) {
+                        spin_wait(spins);
+                    }
+                }
+                return;
+            }
+            std::atomic<uint64_t>& word = lock_bits[i / 64];
+            uint64_t mask = 1ULL << (i % 64);
+            while (word.fetch_or(mask, std::memory_order_acquire) & mask) {
+                while (word.load(std::memory_order_relaxed) & mask) {
+                    spin_wait(spins);
+                }
+            }
+        }
+
+        void unlock(size_t i) {
+            if (is_padded(i)) {
+                padded_slot(i).locked.store(false, std::memory_order_release);
+            } else {
+                lock_bits[i / 64].fetch_and(~(1ULL << (i % 64)), std::memory_order_release);
+            }
+        }
+
+        // threads used by a scan asked to use num_threads: at least 1, and at most one
+        // per 4096 accounts
+        size_t scan_threads(size_t num_threads) const {
+            return std::max<size_t>(1, std::min(num_threads, balances.size() / 4096 + 1));
+        }
+
+        // runs f(begin, end, t) on num_threads blocks of the dense array, num_threads
+        // as given by scan_threads
+        template <typename F>
+        void for_blocks(size_t num_threads, F f) {
+            size_t n = balances.size();
+            size_t block_size = n / num_threads;
+            std::vector<std::thread> workers(num_threads - 1);
+            for (size_t t = 0; t < num_threads - 1; ++t) {
+                workers[t] = std::thread(f, t * block_size, (t + 1) * block_size, t);
+            }
+            f((num_threads - 1) * block_size, n, num_threads - 1);
+            for (size_t t = 0; t < num_threads - 1; ++t) {
+                workers[t].join();
+            }
+        }
+    public:
+        AccountTable(size_t num_accounts, unsigned int init_money)
+            : balances(num_accounts, init_money), lock_bits((num_accounts + 63) / 64),
+              padded_bits((num_accounts + 63) / 64, 0) {
+            for (auto& word : lock_bits) {
+                word.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        AccountTable(const AccountTable& other) = delete;
+
+        AccountTable& operator = (const AccountTable& other) = delete;
+
+        ~AccountTable() {
+            for (auto& entry : padded_index) {
+                delete entry.second;
+            }
+        }
+
+        // gives account i a cache line of its own; not thread-safe
+        void pad(size_t i) {
+            if (is_padded(i)) {
+                return;
+            }
+            PaddedSlot* slot = new PaddedSlot();
+            slot->balance = balances[i];
+            balances[i] = 0;
+            padded_index.insert(std::lower_bound(padded_index.begin(), padded_index.end(), std::make_pair(i, slot)),
+                                std::make_pair(i, slot));
+            padded_bits[i / 64] |= 1ULL << (i % 64);
+        }
+
+        size_t size() const {
+            return balances.size();
+        }
+
+        size_t memory_bytes() const {
+            return balances.size() * sizeof(unsigned int) + lock_bits.size() * sizeof(uint64_t) * 2 +
+                   padded_index.size() * (sizeof(PaddedSlot) + sizeof(padded_index[0]));
+        }
+
+        unsigned int get_amount(size_t i) {
+            return __atomic_load_n(&balance(i), __ATOMIC_RELAXED);
+        }
+
+        bool withdraw(size_t i, unsigned int deduction) {
+            lock(i);
+            unsigned int& b = balance(i);
+            bool done = (b >= deduction);
+            if (done) {
+                store_balance(b, b - deduction);
+            }
+            unlock(i);
+            return done;
+        }
+
+        void add(size_t i, unsigned int to_add) {
+            lock(i);
+            unsigned int& b = balance(i);
+            store_balance(b, b + to_add);
+            unlock(i);
+        }
+
+        // locks are taken in index order, as Account takes them in id order
+        bool transfer(unsigned int amount, size_t from, size_t to) {
+            if (from == to) {
+                return get_amount(from) >= amount;
+            }
+            lock(std::min(from, to));
+            lock(std::max(from, to));
+            unsigned int& f = balance(from);
+            bool done = (f >= amount);
+            if (done) {
+                unsigned int& t = balance(to);
+                store_balance(f, f - amount);
+                store_balance(t, t + amount);
+            }
+            unlock(std::max(from, to));
+            unlock(std::min(from, to));
+            return done;
+        }
+
+        // sum of all the balances (reconciliation)
+        unsigned long long total(size_t num_threads) {
+            num_threads = scan_threads(num_threads);
+            std::vector<unsigned long long> sums(num_threads, 0);
+            for_blocks(num_threads, [this, &sums](size_t begin, size_t end, size_t t) {
+                sums[t] = SumBalances(balances.data() + begin, end - begin);
+            });
+            unsigned long long result = std::accumulate(sums.begin(), sums.end(), 0ULL);
+            for (auto& entry : padded_index) {
+                result += entry.second->balance;
+            }
+            return result;
+        }
+
+        // adds floor(balance * rate) to every balance, 0 <= rate < 1 (with 32 bits of
+        // precision), balances saturating at UINT_MAX, and returns the total interest paid
+        unsigned long long accrue_interest(double rate, size_t num_threads) {
+            uint32_t fixed_rate = (uint32_t) std::min(rate * 4294967296., 4294967295.);
+            num_threads = scan_threads(num_threads);
+            std::vector<unsigned long long> paid(num_threads, 0);
+            for_blocks(num_threads, [this, &paid, fixed_rate](size_t begin, size_t end, size_t t) {
+                paid[t] = AccrueInterest(balances.data() + begin, end - begin, fixed_rate);
+            });
+            unsigned long long result = std::accumulate(paid.begin(), paid.end(), 0ULL);
+            for (auto& entry : padded_index) {
+                unsigned int interest = CappedInterest(entry.second->balance, fixed_rate);
+                entry.second->balance += interest;
+                result += interest;
+            }
+            return result;
+        }
+};
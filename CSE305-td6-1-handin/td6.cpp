@@ -10,6 +10,8 @@
 #include <thread>
 #include <queue>
 
+#include "InstrumentedMutex.cpp"
+
 //----------------------------------------------------------------------------
 
 class OrderedVec {
@@ -53,11 +55,17 @@ void DivideOnceEven(std::condition_variable& iseven, std::mutex& m, int& n) {
 
 //-----------------------------------------------------------------------------
 
+struct SafeUnboundedQueueLockSite {
+    static const char* name() { return "SafeUnboundedQueue::lock"; }
+};
+
 template <class E> 
 class SafeUnboundedQueue {
+        // std::mutex and std::condition_variable unless compiled with LOCK_STATS
+        typedef SiteMutex<std::mutex, SafeUnboundedQueueLockSite> Lock;
         std::queue<E> elements; //thread-safe unbounded queue by using std::queue
-        std::mutex lock;
-        std::condition_variable not_empty; // Condition variable to signal when the queue is not empty
+        Lock lock;
+        SiteConditionVariable<Lock> not_empty; // Condition variable to signal when the queue is not empty
     public: 
         SafeUnboundedQueue<E>(){}
         void push(const E& element);
@@ -70,7 +78,7 @@ class SafeUnboundedQueue {
 // Pushes an element to the queue
 template <class E>
 void SafeUnboundedQueue<E>::push(const E& element) {
-    std::unique_lock<std::mutex> lockk(this->lock);
+    std::unique_lock<Lock> lockk(this->lock);
     bool was_empty = this->elements.empty();
     this->elements.push(element);
     if (was_empty) {
@@ -81,7 +89,7 @@ void SafeUnboundedQueue<E>::push(const E& element) {
 // Pops an element from the queue and returns it
 template <class E> 
 E SafeUnboundedQueue<E>::pop() {
-    std::unique_lock<std::mutex> lockk(this->lock);
+    std::unique_lock<Lock> lockk(this->lock);
     // Wait until the queue is not empty
     while (this->elements.empty()) {
         this->not_empty.wait(lockk);
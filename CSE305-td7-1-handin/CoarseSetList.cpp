@@ -1,3 +1,5 @@
+#include "InstrumentedMutex.cpp"
+
 class CoarseNode {
 public:
     std::string item;
@@ -27,9 +29,15 @@ void DeleteNodeChain(CoarseNode* start) {
     delete prev;
 }
 
+struct CoarseSetListLockSite {
+    static const char* name() { return "CoarseSetList::lock"; }
+};
+
 class CoarseSetList {
 protected:
-    std::recursive_mutex lock;
+    // std::recursive_mutex unless compiled with LOCK_STATS
+    typedef SiteMutex<std::recursive_mutex, CoarseSetListLockSite> Lock;
+    Lock lock;
     CoarseNode* head;
     static const unsigned long LOWEST_KEY = 0;
     static const unsigned long LARGEST_KEY = ULONG_MAX;
@@ -67,7 +75,7 @@ CoarseNode* CoarseSetList::search(const std::string& val) {
     CoarseNode *pred, *curr;
     unsigned long key = std::hash<std::string>{}(val);
     pred = head;
-    std::lock_guard<std::recursive_mutex> lk(lock);
+    std::lock_guard<Lock> lk(lock);
     curr = pred->next;
     while (curr->key < key) {
         pred = curr;
@@ -77,7 +85,7 @@ CoarseNode* CoarseSetList::search(const std::string& val) {
 }
 
 bool CoarseSetList::add(const std::string& val) {
-    std::lock_guard<std::recursive_mutex> lk(lock);
+    std::lock_guard<Lock> lk(lock);
     CoarseNode* pred = this->search(val);
     CoarseNode* curr = pred->next;
     bool exists = (curr->key == std::hash<std::string>{}(val));
@@ -90,7 +98,7 @@ bool CoarseSetList::add(const std::string& val) {
 }
 
 bool CoarseSetList::remove(const std::string& val) {
-    std::lock_guard<std::recursive_mutex> lk(lock);
+    std::lock_guard<Lock> lk(lock);
     CoarseNode* pred = this->search(val);
     CoarseNode* curr = pred->next;
     bool exists = (curr->key == std::hash<std::string>{}(val));
@@ -102,7 +110,7 @@ bool CoarseSetList::remove(const std::string& val) {
 }
 
 bool CoarseSetList::contains(const std::string& val) {
-    std::lock_guard<std::recursive_mutex> lk(lock);
+    std::lock_guard<Lock> lk(lock);
     CoarseNode* pred = this->search(val);
     CoarseNode* curr = pred->next;
     bool exists = (curr->key == std::hash<std::string>{}(val));
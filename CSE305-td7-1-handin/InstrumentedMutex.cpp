@@ -0,0 +1,219 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <type_traits>
+#include <vector>
+
+// Opt-in lock contention statistics. A lock declared as SiteMutex<Mutex, Site> is a plain
+// Mutex unless the code is compiled with -DLOCK_STATS (make LOCK_STATS=1 after a make
+// clean), in which case it is an InstrumentedMutex recording, for all the locks of the
+// site, the attempts to take them, the contended ones, and histograms of the waiting
+// and holding times. DumpLockStats prints them.
+//
+// The td3, td6, td7 and td8 handins each build on their own, so each has a copy of
+// this file: the copies are identical and are changed together.
+
+//-----------------------------------------------------------------------------
+
+// Histogram of durations, bucket b counting durations in [2^b, 2^(b + 1)) nanoseconds
+// (bucket 0 also counts 0ns)
+class DurationHistogram {
+        static const size_t NUM_BUCKETS = 40;
+        std::atomic<unsigned long long> buckets[NUM_BUCKETS];
+    public:
+        DurationHistogram() {
+            reset();
+        }
+
+        void record(std::chrono::steady_clock::duration d) {
+            long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+            size_t b = (ns < 2) ? 0 : 63 - __builtin_clzll(ns);
+            buckets[std::min(b, NUM_BUCKETS - 1)].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void reset() {
+            for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+                buckets[b].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        unsigned long long count() const {
+            unsigned long long total = 0;
+            for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+                total += buckets[b].load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        // upper bound (in ns) of the bucket containing the q-quantile, 0 if empty
+        long long quantile(double q) const {
+            unsigned long long total = count();
+            if (total == 0) {
+                return 0;
+            }
+            unsigned long long seen = 0;
+            for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+                seen += buckets[b].load(std::memory_order_relaxed);
+                if (seen >= q * total) {
+                    return 1LL << (b + 1);
+                }
+            }
+            return 1LL << NUM_BUCKETS;
+        }
+
+        // one line per non empty bucket
+        void print(std::ostream& out, const char* label) const {
+            for (size_t b = 0; b < NUM_BUCKETS; ++b) {
+                unsigned long long c = buckets[b].load(std::memory_order_relaxed);
+                if (c > 0) {
+                    out << "    " << label << " < " << std::setw(12) << (1LL << (b + 1)) << "ns: " << c << "\n";
+                }
+            }
+        }
+};
+
+// Statistics shared by all the locks of a site, registered for DumpLockStats
+struct LockSite {
+    const char* name;
+    // calls to lock and try_lock
+    std::atomic<unsigned long long> attempts;
+    // attempts which found the lock taken: lock which had to wait, failed try_lock
+    std::atomic<unsigned long long> contended;
+    // time to get the lock, contended acquisitions only
+    DurationHistogram wait;
+    // from the (outermost) acquisition to the release
+    DurationHistogram hold;
+
+    LockSite(const char* name);
+
+    void reset() {
+        attempts.store(0);
+        contended.store(0);
+        wait.reset();
+        hold.reset();
+    }
+};
+
+std::mutex& LockSitesMutex() {
+    static std::mutex m;
+    return m;
+}
+
+std::vector<LockSite*>& LockSites() {
+    static std::vector<LockSite*> sites;
+    return sites;
+}
+
+LockSite::LockSite(const char* name) : name(name), attempts(0), contended(0) {
+    std::lock_guard<std::mutex> lk(LockSitesMutex());
+    LockSites().push_back(this);
+}
+
+// prints the statistics of every site used so far
+void DumpLockStats(std::ostream& out) {
+    std::lock_guard<std::mutex> lk(LockSitesMutex());
+    for (const LockSite* site : LockSites()) {
+        unsigned long long attempts = site->attempts.load();
+        unsigned long long contended = site->contended.load();
+        out << site->name << ": " << attempts << " attempts, " << contended << " contended ("
+            << 100. * contended / std::max(1ULL, attempts) << "%)\n";
+        if (site->wait.count() > 0) {
+            out << "  wait p50 < " << site->wait.quantile(0.5) << "ns, p99 < " << site->wait.quantile(0.99) << "ns\n";
+        }
+        out << "  hold p50 < " << site->hold.quantile(0.5) << "ns, p99 < " << site->hold.quantile(0.99) << "ns\n";
+        site->wait.print(out, "wait");
+        site->hold.print(out, "hold");
+    }
+}
+
+void ResetLockStats() {
+    std::lock_guard<std::mutex> lk(LockSitesMutex());
+    for (LockSite* site : LockSites()) {
+        site->reset();
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Mutex (std::mutex, std::recursive_mutex, ...) recording its use in the statistics of
+ * the site Site, a type with a static name() method. An acquisition first tries the
+ * lock and only times the wait if the try failed. For a recursive mutex, only the
+ * outermost acquisition and release are timed.
+ */
+template <typename Mutex, typename Site>
+class InstrumentedMutex {
+        Mutex mutex;
+        // both written only while holding mutex
+        std::chrono::steady_clock::time_point acquired;
+        unsigned int depth;
+
+        void enter(std::chrono::steady_clock::time_point now) {
+            if (depth++ == 0) {
+                acquired = now;
+            }
+        }
+    public:
+        InstrumentedMutex() : depth(0) {}
+
+        InstrumentedMutex(const InstrumentedMutex& other) = delete;
+
+        InstrumentedMutex& operator = (const InstrumentedMutex& other) = delete;
+
+        static LockSite& stats() {
+            static LockSite site(Site::name());
+            return site;
+        }
+
+        void lock() {
+            LockSite& site = stats();
+            site.attempts.fetch_add(1, std::memory_order_relaxed);
+            if (mutex.try_lock()) {
+                enter(std::chrono::steady_clock::now());
+                return;
+            }
+            site.contended.fetch_add(1, std::memory_order_relaxed);
+            auto start = std::chrono::steady_clock::now();
+            mutex.lock();
+            auto now = std::chrono::steady_clock::now();
+            site.wait.record(now - start);
+            enter(now);
+        }
+
+        bool try_lock() {
+            LockSite& site = stats();
+            site.attempts.fetch_add(1, std::memory_order_relaxed);
+            if (!mutex.try_lock()) {
+                site.contended.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            enter(std::chrono::steady_clock::now());
+            return true;
+        }
+
+        void unlock() {
+            if (--depth == 0) {
+                stats().hold.record(std::chrono::steady_clock::now() - acquired);
+            }
+            mutex.unlock();
+        }
+};
+
+#ifdef LOCK_STATS
+template <typename Mutex, typename Site>
+using SiteMutex = InstrumentedMutex<Mutex, Site>;
+#else
+template <typename Mutex, typename Site>
+using SiteMutex = Mutex;
+#endif
+
+// std::condition_variable only waits on std::mutex, the instrumented ones need the _any version
+template <typename Mutex>
+using SiteConditionVariable = typename std::conditional<std::is_same<Mutex, std::mutex>::value,
+                                                        std::condition_variable,
+                                                        std::condition_variable_any>::type;
@@ -1,6 +1,13 @@
+#include "InstrumentedMutex.cpp"
+
+struct NodeLockSite {
+    static const char* name() { return "Node::lock"; }
+};
+
 class Node {
 public:
-    std::mutex lock;
+    // std::mutex unless compiled with LOCK_STATS
+    SiteMutex<std::mutex, NodeLockSite> lock;
     std::string item;
     unsigned long key;
     Node * next;
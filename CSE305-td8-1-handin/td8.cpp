@@ -7,11 +7,19 @@
 #include <thread>
 #include <vector>
 
+#include "InstrumentedMutex.cpp"
+
 //--------- Slightly modified lazy version of SetList from the lecture --------
 
+struct NodeLockSite {
+    static const char* name() { return "Node::lock"; }
+};
+
 class Node {
 public:
-    std::mutex lock;
+    // std::mutex unless compiled with LOCK_STATS
+    typedef SiteMutex<std::mutex, NodeLockSite> Lock;
+    Lock lock;
     std::string item;
     unsigned long key;
     std::shared_ptr<Node> next;
@@ -63,8 +71,8 @@ bool SetList::add(const std::string& val) {
             pred = curr;
             curr = curr->next;
         }
-        std::lock_guard<std::mutex> pred_lk(pred->lock);
-        std::lock_guard<std::mutex> curr_lk(curr->lock);
+        std::lock_guard<Node::Lock> pred_lk(pred->lock);
+        std::lock_guard<Node::Lock> curr_lk(curr->lock);
         if (SetList::validate(pred, curr)) {
             if (key == curr->key) {
                 return false;
@@ -84,8 +92,8 @@ bool SetList::remove(const std::string& val) {
             pred = curr;
             curr = curr->next;
         }
-        std::lock_guard<std::mutex> pred_lk(pred->lock);
-        std::lock_guard<std::mutex> curr_lk(curr->lock);
+        std::lock_guard<Node::Lock> pred_lk(pred->lock);
+        std::lock_guard<Node::Lock> curr_lk(curr->lock);
         if (SetList::validate(pred, curr)) {
             if (key == curr->key) {
                 curr->marked = true;
@@ -107,9 +115,15 @@ bool SetList::contains(const std::string& val) const {
 
 //-----------------------------------------------------------------------------
 
+struct MultiNodeLockSite {
+    static const char* name() { return "MultiNode::lock"; }
+};
+
 class MultiNode {
 public:
-    std::mutex lock;
+    // std::mutex unless compiled with LOCK_STATS
+    typedef SiteMutex<std::mutex, MultiNodeLockSite> Lock;
+    Lock lock;
     std::string item;
     unsigned long key;
     std::shared_ptr<MultiNode> next;
@@ -166,8 +180,8 @@ void MultiSetList::add(const std::string& val) {
             pred = curr;
             curr = curr->next;
         }
-        std::lock_guard<std::mutex> pred_lk(pred->lock);
-        std::lock_guard<std::mutex> curr_lk(curr->lock);
+        std::lock_guard<MultiNode::Lock> pred_lk(pred->lock);
+        std::lock_guard<MultiNode::Lock> curr_lk(curr->lock);
         if (MultiSetList::validate(pred, curr)) {
             if (key == curr->key) {
                 ++curr->multiplicity; // Increase multiplicity if element already exists
@@ -192,8 +206,8 @@ bool MultiSetList::remove(const std::string& val) {
             pred = curr;
             curr = curr->next;
         }
-        std::lock_guard<std::mutex> pred_lk(pred->lock);
-        std::lock_guard<std::mutex> curr_lk(curr->lock);
+        std::lock_guard<MultiNode::Lock> pred_lk(pred->lock);
+        std::lock_guard<MultiNode::Lock> curr_lk(curr->lock);
         if (MultiSetList::validate(pred, curr)) {
             if (key == curr->key) {
                 if (curr->multiplicity > 1) {